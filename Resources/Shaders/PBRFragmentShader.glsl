@@ -17,6 +17,13 @@ struct PointLightSource {
 uniform PointLightSource pointlightSources[1000];
 uniform int pointLightCnt;
 
+struct Material {
+	vec3 albedo;
+	float roughness;
+	vec3 emission;
+};
+uniform Material material; // of the triangle range being drawn
+
 in vec3 fNormal; // Shader input, linearly interpolated by default from the previous stage (here the vertex shader)
 in vec3 fPosition;
 
@@ -55,8 +62,7 @@ float GeomShlick(vec3 N, vec3 w0, vec3 wi, float roughness) {
 vec3 GetLight(vec3 l, vec3 c, vec3 n, vec3 v, float roughness) {
 	l = normalize(l);
 	vec3 h = normalize(l + v);
-	// sample albedo
-	vec3 diffuse = vec3(0.6, 0.9, 0.4) / PI;
+	vec3 diffuse = material.albedo / PI;
 	
 	vec3 F0 = vec3(1.0, 0.71, 0.29);
 	F0 = mix(F0, diffuse, 0.3);
@@ -72,15 +78,15 @@ vec3 GetLight(vec3 l, vec3 c, vec3 n, vec3 v, float roughness) {
 void main () {
 	vec3 n = normalize (fNormal);
 	vec3 v = normalize (-fPosition);
-	colorResponse = vec4(0.0, 0.0, 0.0, 0.0);
+	colorResponse = vec4(material.emission, 0.0);
 	for (int i=0; i < lightCnt; i++) {
 		LightSource lightSource = lightSources[i];
-		colorResponse += lightSource.intensity * vec4(GetLight(normalize(-lightSource.direction), lightSource.color, n, v, 0.1), 1.0);
+		colorResponse += lightSource.intensity * vec4(GetLight(normalize(-lightSource.direction), lightSource.color, n, v, material.roughness), 1.0);
 	}
 	for (int i=0; i < pointLightCnt; i++) {
 		PointLightSource lightSource = pointlightSources[i];
 		lightSource.position = vec3(modelViewMat * vec4(lightSource.position, 1.0));
 		vec3 lightDirection = lightSource.position - fPosition;
-		colorResponse += lightSource.intensity * vec4(GetLight(normalize(lightDirection), lightSource.color, n, v, 0.1), 1.0) / dot(lightDirection, lightDirection);
+		colorResponse += lightSource.intensity * vec4(GetLight(normalize(lightDirection), lightSource.color, n, v, material.roughness), 1.0) / dot(lightDirection, lightDirection);
 	}
 }
\ No newline at end of file
@@ -0,0 +1,89 @@
+#include "AreaLights.hpp"
+#include <random>
+#include <numeric>
+#include <algorithm>
+
+namespace {
+
+struct EmissiveTriangle {
+    glm::vec3 p0;
+    glm::vec3 p1;
+    glm::vec3 p2;
+    glm::vec3 radiance;
+    float area;
+    float weight;
+};
+
+float luminance(glm::vec3 c) {
+    return 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+}
+
+float maxComp(glm::vec3 v) {
+    return std::max(v[0], std::max(v[1], v[2]));
+}
+
+} // namespace
+
+std::vector<std::shared_ptr<PointLight>> AreaLights::sample(const std::shared_ptr<Scene> scenePtr, int sampleCount, unsigned int seed) {
+    std::vector<std::shared_ptr<PointLight>> res;
+    if (sampleCount <= 0) {
+        return res;
+    }
+    std::vector<EmissiveTriangle> triangles;
+    float total = 0.0f;
+    for (size_t i = 0; i < scenePtr->numOfMeshes(); i++) {
+        auto model = scenePtr->mesh(i);
+        const auto& positions = model->mesh->vertexPositions();
+        const auto& triangleIndices = model->mesh->triangleIndices();
+        for (size_t j = 0; j < triangleIndices.size(); j++) {
+            glm::vec3 radiance = model->triangleMaterial(j)->emission;
+            if (!(maxComp(radiance) > 0.0f)) {
+                continue;
+            }
+            const glm::uvec3& tri = triangleIndices[j];
+            glm::vec3 p0 = positions[tri[0]];
+            glm::vec3 p1 = positions[tri[1]];
+            glm::vec3 p2 = positions[tri[2]];
+            float area = 0.5f * glm::length(glm::cross(p1 - p0, p2 - p0));
+            if (!(area > 0.0f)) {
+                continue;
+            }
+            float weight = area * luminance(radiance);
+            triangles.push_back({p0, p1, p2, radiance, area, weight});
+            total += weight;
+        }
+    }
+    if (!(total > 0.0f)) {
+        return res;
+    }
+
+    std::mt19937 generator(seed);
+    std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+    res.reserve(sampleCount + triangles.size());
+    std::vector<int> cells;
+    for (const auto& tri : triangles) {
+        // expected count rounded randomly, so that small triangles still get lit on average
+        float expected = sampleCount * tri.weight / total;
+        int count = (int)expected + (dist(generator) < expected - (int)expected ? 1 : 0);
+        if (count == 0) {
+            continue;
+        }
+        glm::vec3 normal = glm::normalize(glm::cross(tri.p1 - tri.p0, tri.p2 - tri.p0));
+        // each light stands for area / count of the triangle, emitting area / count * radiance along the normal
+        glm::vec3 value = tri.radiance * tri.area / (float)count;
+        float scale = maxComp(value);
+        // stratify on a grid of the unit square, mapped uniformly onto the triangle
+        int m = (int)std::ceil(std::sqrt((float)count));
+        cells.resize(m * m);
+        std::iota(cells.begin(), cells.end(), 0);
+        for (int k = 0; k < count; k++) {
+            std::swap(cells[k], cells[k + (int)(dist(generator) * (m * m - k)) % (m * m - k)]);
+            float u = (cells[k] % m + dist(generator)) / m;
+            float v = (cells[k] / m + dist(generator)) / m;
+            float su = std::sqrt(u);
+            glm::vec3 pos = tri.p0 * (1.0f - su) + tri.p1 * (su * (1.0f - v)) + tri.p2 * (su * v);
+            res.push_back(std::make_shared<PointLight>(pos + normal * 1e-4f, value / scale, scale, normal));
+        }
+    }
+    return res;
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include "Scene.h"
+#include "LightSource.hpp"
+#include <memory>
+#include <vector>
+
+/// Emissive triangles turned into oriented point lights for the light tree.
+namespace AreaLights {
+    /// About sampleCount lights spread over the emissive triangles (Material::emission) of the scene proportionally
+    /// to area x radiance and stratified inside each triangle. Each one faces the triangle normal and carries the
+    /// radiant intensity of the patch it stands for.
+    std::vector<std::shared_ptr<PointLight>> sample(const std::shared_ptr<Scene> scenePtr, int sampleCount, unsigned int seed = 0);
+}
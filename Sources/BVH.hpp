@@ -26,8 +26,8 @@ struct Node {
 template<typename T>
 struct BVH {
 
-    BVH(std::vector<T> primitives): primitives(primitives) {
-        indices.resize(primitives.size());
+    BVH(std::vector<T> primitives): primitives(std::move(primitives)) {
+        indices.resize(this->primitives.size());
         std::iota(indices.begin(), indices.end(), 0);
         tree.resize(0);
     }
@@ -103,7 +103,9 @@ struct BVH {
             -100000
         };
         while (begin != end) {
-            box.update(*begin);
+            for (const auto& p : *begin) {
+                box.update(p);
+            }
             ++begin;
         }
         return box;
@@ -125,6 +127,24 @@ struct BVH {
         checkHit(tree[v].right_idx, r, onHit);
     }
 
+    /// Any-hit query for shadow rays: boxes beyond tMax are skipped and the traversal stops as soon as onHit
+    /// accepts a primitive. Returns true if one was accepted.
+    bool checkAnyHit(int v, const Ray& r, float tMax, const std::function<bool(int)>& onHit) const {
+        if (v == -1) return false;
+        if (!tree[v].box.hasIntersection(r, tMax)) {
+            return false;
+        }
+        if (tree[v].block_size <= 2) {
+            for (int i = tree[v].block_start; i < tree[v].block_start + tree[v].block_size; i++) {
+                if (onHit(indices[i])) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        return checkAnyHit(tree[v].left_idx, r, tMax, onHit) || checkAnyHit(tree[v].right_idx, r, tMax, onHit);
+    }
+
 
     std::vector<Node> tree;
     std::vector<T> primitives;
@@ -39,8 +39,8 @@ BoundingBox3d BoundingBox3d::afterRotation(glm::mat3 r) const {
             } else {
                 point[i] = max_axis(i);
             }
-            res.update(r * point);
         }
+        res.update(r * point);
     }
     return res;
 }
@@ -91,6 +91,16 @@ bool BoundingBox3d::hasIntersection( const Ray& ray) const {
     return tmax >= tmin && tmax > 0;
 }
 
+bool BoundingBox3d::hasIntersection( const Ray& ray, float tMax) const {
+    float tx1 = (x_min - ray.origin.x) / ray.direction.x, tx2 = (x_max - ray.origin.x) / ray.direction.x;
+    float tmin = std::min( tx1, tx2 ), tmax = std::max( tx1, tx2 );
+    float ty1 = (y_min - ray.origin.y) / ray.direction.y, ty2 = (y_max - ray.origin.y) / ray.direction.y;
+    tmin = std::max( tmin, std::min( ty1, ty2 ) ), tmax = std::min( tmax, std::max( ty1, ty2 ) );
+    float tz1 = (z_min - ray.origin.z) / ray.direction.z, tz2 = (z_max - ray.origin.z) / ray.direction.z;
+    tmin = std::max( tmin, std::min( tz1, tz2 ) ), tmax = std::min( tmax, std::max( tz1, tz2 ) );
+    return tmax >= tmin && tmax > 0 && tmin < tMax;
+}
+
 bool BoundingBox3d::contains(glm::vec3 pos) const {
     return x_min <= pos.x <= x_max &&
             y_min <= pos.y <= y_max &&
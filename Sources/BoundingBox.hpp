@@ -26,6 +26,8 @@ struct BoundingBox3d {
     int longest_axis() const;
     std::pair<BoundingBox3d, BoundingBox3d> partition() const;
     bool hasIntersection( const Ray& ray) const;
+    /// Same, ignoring the part of the ray beyond tMax.
+    bool hasIntersection( const Ray& ray, float tMax) const;
 
     bool contains(glm::vec3 pos) const;
     bool contains(const std::vector<glm::vec3>& positions) const;
@@ -7,3 +7,61 @@
 // All rights reserved.
 // ----------------------------------------------
 #include "Camera.h"
+#include "Random.hpp"
+
+#include <cmath>
+
+CameraRayGenerator::CameraRayGenerator (const Camera & camera, size_t width, size_t height) {
+	glm::mat4 viewMat = inverse (camera.computeViewMatrix ());
+	glm::vec3 viewRight = normalize (glm::vec3 (viewMat[0]));
+	glm::vec3 viewUp = normalize (glm::vec3 (viewMat[1]));
+	glm::vec3 viewDir = -normalize (glm::vec3 (viewMat[2]));
+	float w = 2.0*float (tan (glm::radians (camera.getFoV ()/2.0)));
+	m_eye = glm::vec3 (viewMat[3]);
+	m_dx = (camera.getAspectRatio () * w / float (width)) * viewRight;
+	m_dy = (w / float (height)) * viewUp;
+	m_corner = viewDir - 0.5f * camera.getAspectRatio () * w * viewRight - 0.5f * w * viewUp;
+}
+
+void CameraRayGenerator::generateTile (size_t x0, size_t y0, size_t x1, size_t y1, unsigned int sample, unsigned int sampleCount, unsigned int seed, CameraRayBatch & batch) const {
+	size_t tileWidth = x1 - x0;
+	size_t n = tileWidth * (y1 - y0);
+	batch.origin = m_eye;
+	batch.dirX.resize (n);
+	batch.dirY.resize (n);
+	batch.dirZ.resize (n);
+	// R2 sequence: every prefix of the samples spreads evenly over the pixel, so an adaptive pass that stops early
+	// is not biased towards a part of it
+	float baseX = float (std::fmod (0.5 + double (sample) * 0.7548776662466927, 1.0));
+	float baseY = float (std::fmod (0.5 + double (sample) * 0.5698402909980532, 1.0));
+	AlignedVector<float> offsetX (tileWidth, 0.5f);
+	AlignedVector<float> offsetY (tileWidth, 0.5f);
+	for (size_t y = y0; y < y1; y++) {
+		if (sampleCount > 1)
+			for (size_t i = 0; i < tileWidth; i++) {
+				unsigned int h = pixel_seed ((unsigned int)(x0 + i), (unsigned int)y, seed);
+				// per pixel rotation of the sequence, so that neighbouring pixels do not share their offsets
+				float jitterX = baseX + float (h & 0xffffu) * (1.f / 65536.f);
+				float jitterY = baseY + float (h >> 16) * (1.f / 65536.f);
+				offsetX[i] = jitterX < 1.f ? jitterX : jitterX - 1.f;
+				offsetY[i] = jitterY < 1.f ? jitterY : jitterY - 1.f;
+			}
+		float * __restrict dirX = batch.dirX.data () + (y - y0) * tileWidth;
+		float * __restrict dirY = batch.dirY.data () + (y - y0) * tileWidth;
+		float * __restrict dirZ = batch.dirZ.data () + (y - y0) * tileWidth;
+		// pixels of a row are independent, the inner loop vectorizes (sqrt needs -fno-math-errno, see CMakeLists.txt)
+		float rowX = float (x0);
+		#pragma omp simd
+		for (int i = 0; i < int (tileWidth); i++) {
+			float px = rowX + float (i) + offsetX[i];
+			float py = float (y) + offsetY[i];
+			float dx = m_corner[0] + px * m_dx[0] + py * m_dy[0];
+			float dy = m_corner[1] + px * m_dx[1] + py * m_dy[1];
+			float dz = m_corner[2] + px * m_dx[2] + py * m_dy[2];
+			float invLength = 1.f / std::sqrt (dx * dx + dy * dy + dz * dz);
+			dirX[i] = dx * invLength;
+			dirY[i] = dy * invLength;
+			dirZ[i] = dz * invLength;
+		}
+	}
+}
@@ -18,6 +18,7 @@
 
 #include "Transform.h"
 #include "Ray.hpp"
+#include "AlignedAllocator.hpp"
 
 /// Basic camera model
 class Camera : public Transform {
@@ -62,3 +63,38 @@ private:
 	glm::quat curQuat;
 	glm::quat lastQuat;
 };
+
+/// Camera rays of a tile as a structure of arrays, pixels in row-major order.
+struct CameraRayBatch {
+	glm::vec3 origin;
+	AlignedVector<float> dirX;
+	AlignedVector<float> dirY;
+	AlignedVector<float> dirZ;
+	inline Ray ray (size_t i) const { return Ray{origin, glm::vec3 (dirX[i], dirY[i], dirZ[i])}; }
+};
+
+/// Primary rays of one frame. The camera basis and the per pixel steps are computed once, a ray then costs a few
+/// multiply-adds and a normalization instead of a matrix inverse.
+class CameraRayGenerator {
+public:
+	inline CameraRayGenerator () : m_eye (0.f), m_corner (0.f, 0.f, -1.f), m_dx (0.f), m_dy (0.f) {}
+	/// Same rays as Camera::rayAt for an image of width x height pixels.
+	CameraRayGenerator (const Camera & camera, size_t width, size_t height);
+
+	/// Ray through the image point (x, y) in pixels, (0.5, 0.5) being the centre of the first pixel.
+	inline Ray rayAt (float x, float y) const { return Ray{m_eye, glm::normalize (m_corner + x * m_dx + y * m_dy)}; }
+
+	/// Rays through the pixel centres of [x0, x1) x [y0, y1).
+	inline void generateTile (size_t x0, size_t y0, size_t x1, size_t y1, CameraRayBatch & batch) const { generateTile (x0, y0, x1, y1, 0, 1, 0, batch); }
+
+	/// Supersampling: sample out of sampleCount per pixel, taken from a low-discrepancy (R2) sequence rotated by a hash
+	/// of the pixel and the seed, so that the first samples already cover the pixel. A single sample goes through the
+	/// centres.
+	void generateTile (size_t x0, size_t y0, size_t x1, size_t y1, unsigned int sample, unsigned int sampleCount, unsigned int seed, CameraRayBatch & batch) const;
+
+private:
+	glm::vec3 m_eye;
+	glm::vec3 m_corner; // direction through the image corner (0, 0)
+	glm::vec3 m_dx; // direction step of one pixel along x
+	glm::vec3 m_dy;
+};
@@ -5,40 +5,197 @@
 #include <memory>
 #include "Random.hpp"
 #include <queue>
+#include <unordered_map>
 
-void LightTree::build(std::vector<std::shared_ptr<PointLight>> lights_) {
+static BoundingBox3d pointBox(glm::vec3 p) {
+    BoundingBox3d box {
+        100000,
+        -100000,
+        100000,
+        -100000,
+        100000,
+        -100000
+    };
+    box.update(p);
+    return box;
+}
+
+static double boxCost(const BoundingBox3d& bb, float clusterIntensity) {
+    auto dx = bb.x_max - bb.x_min;
+    auto dy = bb.y_max - bb.y_min;
+    auto dz = bb.z_max - bb.z_min;
+    return (dx * dx + dy * dy + dz * dz) * clusterIntensity;
+}
+
+static glm::vec4 normalCone(glm::vec3 normal) {
+    if (normal == glm::vec3(0.0f)) {
+        return glm::vec4(0.0f, 0.0f, 1.0f, -1.0f);
+    }
+    return glm::vec4(glm::normalize(normal), 1.0f);
+}
+
+static glm::vec3 towards(const DirectionalLight& light) {
+    return -glm::normalize(light.direction);
+}
+
+/// Smallest cone (axis, cosine of the half angle) containing both cones.
+static glm::vec4 mergeCones(glm::vec4 a, glm::vec4 b) {
+    glm::vec3 axisA(a);
+    glm::vec3 axisB(b);
+    float thetaA = std::acos(glm::clamp(a.w, -1.0f, 1.0f));
+    float thetaB = std::acos(glm::clamp(b.w, -1.0f, 1.0f));
+    float thetaD = std::acos(glm::clamp(glm::dot(axisA, axisB), -1.0f, 1.0f));
+    if (thetaD + thetaB <= thetaA) {
+        return a;
+    }
+    if (thetaD + thetaA <= thetaB) {
+        return b;
+    }
+    float theta = (thetaA + thetaD + thetaB) / 2;
+    if (theta >= PI) {
+        return glm::vec4(axisA, -1.0f);
+    }
+    // rotate axisA towards axisB in their common plane
+    glm::vec3 ortho = axisB - axisA * glm::dot(axisA, axisB);
+    if (glm::length(ortho) < 1e-6f) {
+        ortho = glm::cross(axisA, std::abs(axisA.x) < 0.9f ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f));
+    }
+    ortho = glm::normalize(ortho);
+    float phi = theta - thetaA;
+    return glm::vec4(glm::normalize(axisA * std::cos(phi) + ortho * std::sin(phi)), std::cos(theta));
+}
+
+/// Largest emission cosine of a light inside the box with a normal inside the cone, towards position.
+static float emitterCosBound(glm::vec4 cone, const BoundingBox3d& box, glm::vec3 position) {
+    if (cone.w <= -1.0f) {
+        return 1.0f;
+    }
+    // directions from the box to position fit in a cone around the direction from the box centre
+    glm::vec3 center = (box.p1() + box.p2()) * 0.5f;
+    float radius = glm::length(box.p2() - box.p1()) * 0.5f;
+    glm::vec3 dir = position - center;
+    float dist = glm::length(dir);
+    if (dist <= radius) {
+        return 1.0f;
+    }
+    float cosTheta = glm::clamp(glm::dot(glm::vec3(cone), dir / dist), -1.0f, 1.0f);
+    float theta = std::acos(cosTheta) - std::acos(glm::clamp(cone.w, -1.0f, 1.0f)) - std::asin(radius / dist);
+    return theta <= 0.0f ? 1.0f : std::max(0.0f, std::cos(theta));
+}
+
+/// Largest cosine between d and a direction inside the cone.
+static float coneCosBound(glm::vec4 cone, glm::vec3 d) {
+    float cosTheta = glm::clamp(glm::dot(glm::vec3(cone), glm::normalize(d)), -1.0f, 1.0f);
+    if (cosTheta >= cone.w) {
+        return 1.0f;
+    }
+    return std::max(0.0f, std::cos(std::acos(cosTheta) - std::acos(glm::clamp(cone.w, -1.0f, 1.0f))));
+}
+
+int LightTree::allocateNode() {
+    if (!free_nodes.empty()) {
+        int idx = free_nodes.back();
+        free_nodes.pop_back();
+        return idx;
+    }
+    bounds.emplace_back();
+    intensity.emplace_back();
+    rep_position.emplace_back();
+    rep_color.emplace_back();
+    rep_normal.emplace_back();
+    left.emplace_back();
+    right.emplace_back();
+    parent.emplace_back();
+    light_idx.emplace_back();
+    cone.emplace_back();
+    directional.emplace_back();
+    return size() - 1;
+}
+
+int LightTree::addNode(const BoundingBox3d& box, float nodeIntensity, int light, int l, int r) {
+    int idx = allocateNode();
+    bounds[idx] = box;
+    intensity[idx] = nodeIntensity;
+    rep_position[idx] = lights[light]->getTranslation();
+    rep_color[idx] = lights[light]->color;
+    rep_normal[idx] = lights[light]->normal;
+    left[idx] = l;
+    right[idx] = r;
+    parent[idx] = -1;
+    light_idx[idx] = light;
+    cone[idx] = l == -1 ? normalCone(lights[light]->normal) : mergeCones(cone[l], cone[r]);
+    directional[idx] = 0;
+    if (l != -1) {
+        parent[l] = idx;
+        parent[r] = idx;
+    }
+    return idx;
+}
+
+void LightTree::build(std::vector<std::shared_ptr<PointLight>> lights_, const std::atomic<bool>* cancelled) {
     this->lights = lights_;
-    tree.resize(0);
+    for (auto* arr : {&left, &right, &parent, &light_idx}) {
+        arr->clear();
+    }
+    bounds.clear();
+    intensity.clear();
+    rep_position.clear();
+    rep_color.clear();
+    rep_normal.clear();
+    cone.clear();
+    directional.clear();
+    free_nodes.clear();
+    light_leaf.resize(lights.size());
+    std::iota(light_leaf.begin(), light_leaf.end(), 0);
+    root = -1;
+    dir_root = -1;
+    build_cost = 0.0;
+    if (lights.empty()) {
+        buildDirectional(dir_lights);
+        return;
+    }
+    size_t capacity = 2 * lights.size() - 1;
+    bounds.reserve(capacity);
+    intensity.reserve(capacity);
+    rep_position.reserve(capacity);
+    rep_color.reserve(capacity);
+    rep_normal.reserve(capacity);
+    cone.reserve(capacity);
+    directional.reserve(capacity);
+    for (auto* arr : {&left, &right, &parent, &light_idx}) {
+        arr->reserve(capacity);
+    }
     for (int i = 0; i < lights.size(); i++) {
-        LightCutNode node;
-        node.light_idx = i;
-        node.intensity = lights[i]->intensity;
-        node.box = BoundingBox3d {
-            100000,
-            -100000,
-            100000,
-            -100000,
-            100000,
-            -100000
-        };
-        node.box.update(lights[i]->getTranslation());
-        tree.push_back(node);
+        addNode(pointBox(lights[i]->getTranslation()), lights[i]->intensity, i);
     }
+    auto stop = [&]() {
+        if (!cancelled || !*cancelled) {
+            return false;
+        }
+        root = -1;
+        return true;
+    };
     std::vector<int> active_clusters(lights.size());
     std::iota(active_clusters.begin(), active_clusters.end(), 0);
-    auto node = [&](int i) {
-        return tree[active_clusters[i]];
-    };
+    if (stop()) {
+        return;
+    }
+    if (lights.size() > agglomerative_limit) {
+        // the greedy clustering below is cubic in the number of lights
+        root = buildTopDown(active_clusters, 0, active_clusters.size());
+        build_cost = cost();
+        buildDirectional(dir_lights);
+        return;
+    }
     auto score = [&](int i, int j) {
-        BoundingBox3d bb = node(i).box;
-        bb.update(node(j).box);
-        auto dx = bb.x_max - bb.x_min;
-        auto dy = bb.y_max - bb.y_min;
-        auto dz = bb.z_max - bb.z_min;
-        return (dx * dx + dy * dy + dz * dz)
-                    * (lights[node(i).light_idx]->intensity + lights[node(j).light_idx]->intensity);
+        BoundingBox3d bb = bounds[active_clusters[i]];
+        bb.update(bounds[active_clusters[j]]);
+        return boxCost(bb, lights[light_idx[active_clusters[i]]]->intensity + lights[light_idx[active_clusters[j]]]->intensity);
     };
     while (active_clusters.size() > 1) {
+        if (stop()) {
+            return;
+        }
         int cur_i = 0;
         int cur_j = 1;
         double cur_tmp = 1e18;
@@ -51,216 +208,634 @@ void LightTree::build(std::vector<std::shared_ptr<PointLight>> lights_) {
                 }
             }
         }
-        LightCutNode united;
-        united.left_idx = active_clusters[cur_i];
-        united.right_idx = active_clusters[cur_j];
-        united.box = node(cur_i).box;
-        united.box.update(node(cur_j).box);
-        if (rand_between(0, node(cur_i).intensity + node(cur_j).intensity) < node(cur_i).intensity) {
-            united.light_idx = node(cur_i).light_idx;
-        } else {
-            united.light_idx = node(cur_j).light_idx;
-        }
-        united.intensity = node(cur_i).intensity + node(cur_j).intensity;
-        active_clusters.push_back(tree.size());
-        tree.push_back(united);
+        int a = active_clusters[cur_i];
+        int b = active_clusters[cur_j];
+        BoundingBox3d box = bounds[a];
+        box.update(bounds[b]);
+        int light = rand_between(0, intensity[a] + intensity[b]) < intensity[a] ? light_idx[a] : light_idx[b];
+        active_clusters.push_back(addNode(box, intensity[a] + intensity[b], light, a, b));
         active_clusters.erase(active_clusters.begin() + cur_j);
         active_clusters.erase(active_clusters.begin() + cur_i);
     }
-    // std::queue<int> q;
-    // q.push(tree.size() - 1);
-    // while (!q.empty()) {
-    //     int v = q.front();
-    //     q.pop();
-    //     // std::cout << v << ' ';
-    //     if (tree[v].left_idx == -1) {
-    //         // std::cout << '\n';
-    //         continue;
-    //     }
-    //     // std::cout << tree[v].left_idx << ' ' << tree[v].right_idx << '\n';
-    //     q.push(tree[v].left_idx);
-    //     q.push(tree[v].right_idx);
-    // }
-}
-
-glm::vec3 LightTree::getLight(LightCutNode node, glm::vec3 position, const BRDF& brdf, BRDFArgs& args) {
-    if (node.last_updated_light == timer) {
-        return node.light;
-    }
-    node.last_updated_light = timer;
-    auto light = selectLightNode(node, true);
-    auto dir = light->getTranslation() - position;
-    auto dirNorm = glm::length(dir);
-    args.lightDir = glm::normalize(dir);
-    return node.light = light->color * light->intensity * brdf(args) / dirNorm / dirNorm;
+    root = size() - 1;
+    build_cost = cost();
+    buildDirectional(dir_lights);
 }
 
-std::shared_ptr<PointLight> LightTree::selectLightNode(LightCutNode node, bool map_intensity, double rnd) {
-    if (node.left_idx == -1 || !map_intensity) {
-        return lights[node.light_idx];
+int LightTree::buildTopDown(std::vector<int>& ids, int begin, int end) {
+    if (end - begin == 1) {
+        // leaves were added first, node i holds light i
+        return ids[begin];
+    }
+    BoundingBox3d box = bounds[ids[begin]];
+    for (int i = begin + 1; i < end; i++) {
+        box.update(bounds[ids[i]]);
     }
-    if (!enable_sampling) {
-        auto res = std::make_shared<PointLight>(*lights[node.light_idx]);
-        res->intensity = node.intensity;
+    int axis = box.longest_axis();
+    int mid = (begin + end) / 2;
+    std::nth_element(ids.begin() + begin, ids.begin() + mid, ids.begin() + end, [&](int a, int b) {
+        return rep_position[a][axis] < rep_position[b][axis];
+    });
+    int l = buildTopDown(ids, begin, mid);
+    int r = buildTopDown(ids, mid, end);
+    box = bounds[l];
+    box.update(bounds[r]);
+    int light = rand_between(0, intensity[l] + intensity[r]) < intensity[l] ? light_idx[l] : light_idx[r];
+    return addNode(box, intensity[l] + intensity[r], light, l, r);
+}
+
+int LightTree::addDirectionalNode(int light, int l, int r) {
+    int idx = allocateNode();
+    if (l == -1) {
+        glm::vec3 d = towards(dir_lights[light]);
+        bounds[idx] = pointBox(d);
+        intensity[idx] = dir_lights[light].intensity;
+        rep_position[idx] = d;
+        rep_color[idx] = dir_lights[light].color;
+        rep_normal[idx] = glm::vec3(0.0f);
+        cone[idx] = glm::vec4(d, 1.0f);
+    } else {
+        bounds[idx] = bounds[l];
+        bounds[idx].update(bounds[r]);
+        intensity[idx] = intensity[l] + intensity[r];
+        int rep = rand_between(0, intensity[idx]) < intensity[l] ? l : r;
+        light = light_idx[rep];
+        rep_position[idx] = rep_position[rep];
+        rep_color[idx] = rep_color[rep];
+        rep_normal[idx] = glm::vec3(0.0f);
+        cone[idx] = mergeCones(cone[l], cone[r]);
+        parent[l] = idx;
+        parent[r] = idx;
+    }
+    left[idx] = l;
+    right[idx] = r;
+    parent[idx] = -1;
+    light_idx[idx] = light;
+    directional[idx] = 1;
+    return idx;
+}
+
+int LightTree::buildDirectional(std::vector<int>& ids, int begin, int end) {
+    if (end - begin == 1) {
+        return addDirectionalNode(ids[begin]);
+    }
+    // median split along the widest axis of the directions
+    BoundingBox3d box = pointBox(towards(dir_lights[ids[begin]]));
+    for (int i = begin + 1; i < end; i++) {
+        box.update(towards(dir_lights[ids[i]]));
+    }
+    int axis = box.longest_axis();
+    int mid = (begin + end) / 2;
+    std::nth_element(ids.begin() + begin, ids.begin() + mid, ids.begin() + end, [&](int a, int b) {
+        return towards(dir_lights[a])[axis] < towards(dir_lights[b])[axis];
+    });
+    int l = buildDirectional(ids, begin, mid);
+    int r = buildDirectional(ids, mid, end);
+    return addDirectionalNode(-1, l, r);
+}
+
+void LightTree::buildDirectional(const std::vector<DirectionalLight>& lights_) {
+    dir_lights = lights_;
+    // the previous direction subtree goes back to the free list
+    if (dir_root != -1) {
+        std::vector<int> stack{dir_root};
+        while (!stack.empty()) {
+            int v = stack.back();
+            stack.pop_back();
+            free_nodes.push_back(v);
+            if (!isLeaf(v)) {
+                stack.push_back(left[v]);
+                stack.push_back(right[v]);
+            }
+        }
+    }
+    dir_root = -1;
+    std::vector<int> ids;
+    for (int i = 0; i < dir_lights.size(); i++) {
+        if (dir_lights[i].intensity > 0.0f) {
+            ids.push_back(i);
+        }
+    }
+    if (!ids.empty()) {
+        dir_root = buildDirectional(ids, 0, ids.size());
+    }
+}
+
+double LightTree::cost() const {
+    double res = 0.0;
+    if (root == -1) {
         return res;
+    }
+    std::vector<int> stack{root};
+    while (!stack.empty()) {
+        int v = stack.back();
+        stack.pop_back();
+        if (isLeaf(v)) {
+            continue;
+        }
+        res += boxCost(bounds[v], intensity[v]);
+        stack.push_back(left[v]);
+        stack.push_back(right[v]);
+    }
+    return res;
+}
+
+void LightTree::setLeaf(int node, int light) {
+    bounds[node] = pointBox(lights[light]->getTranslation());
+    intensity[node] = lights[light]->intensity;
+    rep_position[node] = lights[light]->getTranslation();
+    rep_color[node] = lights[light]->color;
+    rep_normal[node] = lights[light]->normal;
+    cone[node] = normalCone(lights[light]->normal);
+}
+
+void LightTree::refit(int node) {
+    for (int v = node; v != -1; v = parent[v]) {
+        int l = left[v];
+        int r = right[v];
+        bounds[v] = bounds[l];
+        bounds[v].update(bounds[r]);
+        intensity[v] = intensity[l] + intensity[r];
+        cone[v] = mergeCones(cone[l], cone[r]);
+        // keep the representative while it is still one of the children's, so animated lights do not flicker
+        if (light_idx[v] != light_idx[l] && light_idx[v] != light_idx[r]) {
+            light_idx[v] = rand_between(0, intensity[v]) < intensity[l] ? light_idx[l] : light_idx[r];
+        }
+        int rep = light_idx[v] == light_idx[l] ? l : r;
+        rep_position[v] = rep_position[rep];
+        rep_color[v] = rep_color[rep];
+        rep_normal[v] = rep_normal[rep];
+    }
+}
+
+void LightTree::updateLight(int light) {
+    int leaf = light_leaf[light];
+    setLeaf(leaf, light);
+    refit(parent[leaf]);
+}
+
+int LightTree::insertLight(std::shared_ptr<PointLight> light) {
+    int idx = lights.size();
+    lights.push_back(light);
+    int leaf = addNode(pointBox(light->getTranslation()), light->intensity, idx);
+    light_leaf.push_back(leaf);
+    if (root == -1) {
+        root = leaf;
+        return idx;
+    }
+    // descend towards the child whose clustering cost grows the least
+    int sibling = root;
+    while (!isLeaf(sibling)) {
+        double growth[2];
+        int children[2] = {left[sibling], right[sibling]};
+        for (int k = 0; k < 2; k++) {
+            BoundingBox3d bb = bounds[children[k]];
+            bb.update(bounds[leaf]);
+            growth[k] = boxCost(bb, intensity[children[k]] + intensity[leaf]) - boxCost(bounds[children[k]], intensity[children[k]]);
+        }
+        sibling = growth[0] <= growth[1] ? children[0] : children[1];
+    }
+    int grandparent = parent[sibling];
+    BoundingBox3d box = bounds[sibling];
+    box.update(bounds[leaf]);
+    int node = addNode(box, intensity[sibling] + intensity[leaf], light_idx[sibling], sibling, leaf);
+    parent[node] = grandparent;
+    if (grandparent == -1) {
+        root = node;
+    } else if (left[grandparent] == sibling) {
+        left[grandparent] = node;
     } else {
-        if (rnd < 0) {
-            rnd = rand_between(0, node.intensity);
+        right[grandparent] = node;
+    }
+    refit(node);
+    return idx;
+}
+
+void LightTree::removeLight(int light) {
+    int leaf = light_leaf[light];
+    lights[light] = nullptr;
+    light_leaf[light] = -1;
+    free_nodes.push_back(leaf);
+    int p = parent[leaf];
+    if (p == -1) {
+        root = -1;
+        return;
+    }
+    // the sibling takes the place of the parent
+    int sibling = left[p] == leaf ? right[p] : left[p];
+    int grandparent = parent[p];
+    free_nodes.push_back(p);
+    parent[sibling] = grandparent;
+    if (grandparent == -1) {
+        root = sibling;
+        return;
+    }
+    if (left[grandparent] == p) {
+        left[grandparent] = sibling;
+    } else {
+        right[grandparent] = sibling;
+    }
+    refit(grandparent);
+}
+
+bool LightTree::sync(const std::vector<std::shared_ptr<PointLight>>& current, const std::atomic<bool>* cancelled) {
+    if (root == -1) {
+        build(current, cancelled);
+        return true;
+    }
+    std::unordered_map<const PointLight*, int> index;
+    for (int i = 0; i < lights.size(); i++) {
+        if (lights[i]) {
+            index[lights[i].get()] = i;
+        }
+    }
+    std::vector<char> present(lights.size(), 0);
+    std::vector<int> changed;
+    std::vector<std::shared_ptr<PointLight>> added;
+    for (const auto& light : current) {
+        auto it = index.find(light.get());
+        if (it == index.end()) {
+            added.push_back(light);
+            continue;
+        }
+        int i = it->second;
+        present[i] = 1;
+        int leaf = light_leaf[i];
+        if (rep_position[leaf] != light->getTranslation() || rep_color[leaf] != light->color || intensity[leaf] != light->intensity || rep_normal[leaf] != light->normal) {
+            changed.push_back(i);
+        }
+    }
+    for (int i = 0; i < present.size(); i++) {
+        if (lights[i] && !present[i]) {
+            removeLight(i);
         }
-        if (rnd < tree[node.left_idx].intensity) {
-            auto res = std::make_shared<PointLight>(*selectLightNode(tree[node.left_idx], rnd));
-            node.light_idx = tree[node.left_idx].light_idx;
-            res->intensity = node.intensity;
-            return res;
+    }
+    for (int i : changed) {
+        updateLight(i);
+    }
+    for (const auto& light : added) {
+        insertLight(light);
+    }
+    if (root == -1 || cost() > rebuild_threshold * build_cost) {
+        build(current, cancelled);
+        return true;
+    }
+    return false;
+}
+
+glm::vec3 LightTree::getLight(int node, glm::vec3 position, const BRDF& brdf, BRDFArgs& args, LightCutScratch& scratch) const {
+    if (scratch.last_updated_light[node] == scratch.timer) {
+        return scratch.light[node];
+    }
+    scratch.last_updated_light[node] = scratch.timer;
+    auto light = selectLightNode(node, true);
+    if (light.directional) {
+        args.lightDir = light.position;
+        return scratch.light[node] = light.color * light.intensity * brdf(args);
+    }
+    auto dir = light.position - position;
+    auto dirNorm = glm::length(dir);
+    args.lightDir = glm::normalize(dir);
+    float emission = emitterCosine(light.normal, -args.lightDir);
+    return scratch.light[node] = light.color * light.intensity * emission * brdf(args) / dirNorm / dirNorm;
+}
+
+LightSample LightTree::selectLightNode(int node, bool map_intensity, double rnd) const {
+    LightSample res{rep_position[node], rep_color[node], intensity[node], node, isDirectional(node), rep_normal[node]};
+    if (isLeaf(node) || !map_intensity || !enable_sampling) {
+        return res;
+    }
+    // pick the representative at random, proportionally to the intensity of the leaves
+    if (rnd < 0) {
+        rnd = rand_between(0, intensity[node]);
+    }
+    int v = node;
+    while (!isLeaf(v)) {
+        if (rnd < intensity[left[v]]) {
+            v = left[v];
         } else {
-            auto res = std::make_shared<PointLight>(*selectLightNode(tree[node.right_idx], rnd - tree[node.left_idx].intensity));
-            node.light_idx = tree[node.right_idx].light_idx;
-            res->intensity = node.intensity;
-            return res;
+            rnd -= intensity[left[v]];
+            v = right[v];
         }
     }
+    res.position = rep_position[v];
+    res.color = rep_color[v];
+    res.normal = rep_normal[v];
+    return res;
 }
 
-std::vector<std::shared_ptr<PointLight>> LightTree::getLights(glm::vec3 position, const BRDF& brdf, BRDFArgs& args, bool print) {
-    timer++;
-    float PI = glm::pi<float>();
-    int root = tree.size() - 1;
-    auto get_cos_bound = [&](BoundingBox3d bb, glm::vec3 a) {
-        bb.x_min -= position[0];
-        bb.x_max -= position[0];
-        bb.y_min -= position[1];
-        bb.y_max -= position[1];
-        bb.z_min -= position[2];
-        bb.z_max -= position[2];
-        auto b = glm::vec3(0.0, 0.0, 1.0);
-        glm::vec3 axis = glm::cross(a, b);
-        float angle = std::acos(glm::dot(glm::normalize(a), glm::normalize(b)));
+static float getCosBound(BoundingBox3d bb, glm::vec3 position, glm::vec3 a) {
+    bb.x_min -= position[0];
+    bb.x_max -= position[0];
+    bb.y_min -= position[1];
+    bb.y_max -= position[1];
+    bb.z_min -= position[2];
+    bb.z_max -= position[2];
+    auto b = glm::vec3(0.0, 0.0, 1.0);
+    glm::vec3 axis = glm::cross(a, b);
+    glm::mat3 rotationMatrix(1.0f);
+    if (glm::length(axis) > 1e-6f) {
+        float angle = std::acos(glm::clamp(glm::dot(glm::normalize(a), glm::normalize(b)), -1.0f, 1.0f));
 
         // Construct rotation matrix
-        glm::mat3 rotationMatrix = glm::rotate(glm::mat4(1.0f), angle, axis);
+        rotationMatrix = glm::rotate(glm::mat4(1.0f), angle, axis);
 
         if ((rotationMatrix * a).z < 0) {
             rotationMatrix = glm::rotate(glm::mat4(1.0f), -angle, axis);
         }
-        auto newBB = bb.afterRotation(rotationMatrix);
-        
-
-        auto z_max = std::max(newBB.z_max, newBB.z_min);
-        if (z_max <= 0) return 0.0f;
-        auto x_min = std::min(std::abs(newBB.x_min), std::abs(newBB.x_max));
-        if (newBB.x_max >= 0 && newBB.x_min <= 0) x_min = 0.0;
-        auto y_min = std::min(std::abs(newBB.y_min), std::abs(newBB.y_max));
-        if (newBB.y_max >= 0 && newBB.y_min <= 0) y_min = 0.0;
-        return z_max / std::sqrt(x_min * x_min + y_min * y_min + z_max * z_max);
-    };
+    } else if (a.z < 0) {
+        // a is already aligned with -z, flip it around x
+        rotationMatrix = glm::mat3(1.0f, 0.0f, 0.0f, 0.0f, -1.0f, 0.0f, 0.0f, 0.0f, -1.0f);
+    }
+    auto newBB = bb.afterRotation(rotationMatrix);
 
-    auto estimate_error = [&](LightCutNode node) { 
-        if (node.last_updated == timer) {
-            return node.error_bound;
-        }
-        node.last_updated = timer;
-        if (node.left_idx == -1) {
-            return node.error_bound = glm::vec3(-1.0f);
-        }
 
-        auto light = selectLightNode(node, true); 
-        auto length = glm::length(light->getTranslation() - position);
-        float g = 0;
-        for (int i = 0; i < 3; i++)  {
-            if (position[i] < node.box.min_axis(i)) {
-                g += (node.box.min_axis(i) - position[i]) * (node.box.min_axis(i) - position[i]);
-            } else if (position[i] > node.box.max_axis(i)) {
-                g += (position[i] - node.box.max_axis(i)) * (position[i] - node.box.max_axis(i));
-            }
-        }
-        if (g < 0.01f) {
-            return node.error_bound = glm::vec3(1e18f);
+    auto z_max = std::max(newBB.z_max, newBB.z_min);
+    if (z_max <= 0) return 0.0f;
+    auto x_min = std::min(std::abs(newBB.x_min), std::abs(newBB.x_max));
+    if (newBB.x_max >= 0 && newBB.x_min <= 0) x_min = 0.0;
+    auto y_min = std::min(std::abs(newBB.y_min), std::abs(newBB.y_max));
+    if (newBB.y_max >= 0 && newBB.y_min <= 0) y_min = 0.0;
+    return z_max / std::sqrt(x_min * x_min + y_min * y_min + z_max * z_max);
+}
+
+static float squaredDistance(const BoundingBox3d& box, glm::vec3 position) {
+    float g = 0;
+    for (int i = 0; i < 3; i++)  {
+        if (position[i] < box.min_axis(i)) {
+            g += (box.min_axis(i) - position[i]) * (box.min_axis(i) - position[i]);
+        } else if (position[i] > box.max_axis(i)) {
+            g += (position[i] - box.max_axis(i)) * (position[i] - box.max_axis(i));
         }
-        g = 1.0 / g;
+    }
+    return g;
+}
 
-        float dot_bound = get_cos_bound(node.box, args.normal);
-        glm::vec3 r = glm::dot(args.cameraDir, args.normal) * 2 * args.normal - args.cameraDir;
+static float maxComp(glm::vec3 v) {
+    return std::max(v[0], std::max(v[1], v[2]));
+}
 
-        float other_dot_bound = get_cos_bound(node.box, r);
-        if (only_diffuse) {
-            other_dot_bound = 1.0;
-        }
-        glm::vec3 diffuse = brdf.material->kd * glm::vec3(1.0) / PI * dot_bound;
-        glm::vec3 specular = brdf.material->ks * glm::vec3(1.0) * other_dot_bound;
-        float v = 1.0f;
-        glm::vec3 m = diffuse + specular;
-        auto res = node.intensity * g * v * m;
-        for (int i = 0; i < 3; i++) {
-            res[i] = std::abs(res[i]);
+glm::vec3 LightTree::boundContribution(int node, glm::vec3 position, const BRDF& brdf, const BRDFArgs& args, float dist2) const {
+    float g = 1.0 / dist2;
+
+    glm::vec3 r = glm::dot(args.cameraDir, args.normal) * 2 * args.normal - args.cameraDir;
+    float dot_bound;
+    float other_dot_bound;
+    if (isDirectional(node)) {
+        dot_bound = coneCosBound(cone[node], args.normal);
+        other_dot_bound = coneCosBound(cone[node], r);
+    } else {
+        dot_bound = getCosBound(bounds[node], position, args.normal);
+        other_dot_bound = getCosBound(bounds[node], position, r);
+    }
+    if (only_diffuse) {
+        other_dot_bound = 1.0;
+    }
+    glm::vec3 diffuse = brdf.material->kd * glm::vec3(1.0) / PI * dot_bound;
+    glm::vec3 specular = brdf.material->ks * glm::vec3(1.0) * other_dot_bound;
+    float v = 1.0f;
+    float emission = isDirectional(node) ? 1.0f : emitterCosBound(cone[node], bounds[node], position);
+    glm::vec3 m = diffuse + specular;
+    auto res = intensity[node] * g * v * emission * m;
+    for (int i = 0; i < 3; i++) {
+        res[i] = std::abs(res[i]);
+    }
+    return res;
+}
+
+glm::vec3 LightTree::errorBound(int node, glm::vec3 position, const BRDF& brdf, const BRDFArgs& args) const {
+    if (isLeaf(node)) {
+        return glm::vec3(-1.0f);
+    }
+    if (isDirectional(node)) {
+        // no distance falloff, only the cone of directions bounds the cosines
+        return boundContribution(node, position, brdf, args, 1.0f);
+    }
+    float g = squaredDistance(bounds[node], position);
+    if (g < 0.01f) {
+        return glm::vec3(1e18f);
+    }
+    return boundContribution(node, position, brdf, args, g);
+}
+
+std::vector<LightSample> LightTree::getLights(glm::vec3 position, const BRDF& brdf, BRDFArgs& args, LightCutScratch& scratch, int budget, bool* budgetHit, std::vector<int>* seedCut, bool print) const {
+    std::vector<LightSample> res;
+    getLights(position, brdf, args, scratch, res, budget, budgetHit, seedCut, print);
+    return res;
+}
+
+void LightTree::getLights(glm::vec3 position, const BRDF& brdf, BRDFArgs& args, LightCutScratch& scratch, std::vector<LightSample>& res, int budget, bool* budgetHit, std::vector<int>* seedCut, bool print) const {
+    if (budgetHit) {
+        *budgetHit = false;
+    }
+    if (root == -1 && dir_root == -1) {
+        return;
+    }
+    if ((int)scratch.last_updated.size() != size()) {
+        scratch.error_bound.assign(size(), glm::vec3(0.0f));
+        scratch.light.assign(size(), glm::vec3(0.0f));
+        scratch.last_updated.assign(size(), 0);
+        scratch.last_updated_light.assign(size(), 0);
+    }
+    scratch.timer++;
+    if (budget <= 0 || budget > max_cut_size) {
+        budget = max_cut_size;
+    }
+    auto estimate_error = [&](int node) {
+        if (scratch.last_updated[node] == scratch.timer) {
+            return scratch.error_bound[node];
         }
-        return node.error_bound = res;
+        scratch.last_updated[node] = scratch.timer;
+        return scratch.error_bound[node] = errorBound(node, position, brdf, args);
     };
-    glm::vec3 illumination = getLight(tree[root], position, brdf, args);
-    float coeff = 0.007;
-    auto max_comp = [](glm::vec3 v) {
-        return std::max(v[0], std::max(v[1], v[2]));
+    auto accurate = [&](glm::vec3 err_est, glm::vec3 illumination) {
+        return err_est[0] <= error_ratio * illumination[0] && err_est[1] <= error_ratio * illumination[1] && err_est[2] <= error_ratio * illumination[2];
     };
+    std::vector<int>& s = scratch.heap;
+    s.clear();
+    glm::vec3 illumination{0.0f};
+    if (seedCut && !seedCut->empty() && (int)seedCut->size() <= budget) {
+        // start from the cut of a neighbouring shading point
+        s = *seedCut;
+        for (int idx : s) {
+            illumination += getLight(idx, position, brdf, args, scratch);
+        }
+        // coarsen: collapse sibling pairs whose parent is already accurate enough here
+        std::vector<int> merged;
+        do {
+            merged.clear();
+            std::sort(s.begin(), s.end());
+            for (int idx : s) {
+                int p = parent[idx];
+                if (p == -1 || left[p] != idx || !std::binary_search(s.begin(), s.end(), right[p])) {
+                    continue;
+                }
+                if (accurate(estimate_error(p), illumination)) {
+                    merged.push_back(p);
+                }
+            }
+            if (merged.empty()) {
+                break;
+            }
+            std::vector<int> next;
+            next.reserve(s.size());
+            for (int idx : s) {
+                int p = parent[idx];
+                if (p == -1 || std::find(merged.begin(), merged.end(), p) == merged.end()) {
+                    next.push_back(idx);
+                }
+            }
+            next.insert(next.end(), merged.begin(), merged.end());
+            s.swap(next);
+            illumination = glm::vec3(0.0f);
+            for (int idx : s) {
+                illumination += getLight(idx, position, brdf, args, scratch);
+            }
+        } while (true);
+    } else {
+        for (int r : {root, dir_root}) {
+            if (r != -1) {
+                s.push_back(r);
+                illumination += getLight(r, position, brdf, args, scratch);
+            }
+        }
+    }
     auto cmp = [&](int i, int j) {
-        LightCutNode a = tree[i];
-        LightCutNode b = tree[j];
-        
-        if (a.left_idx == -1) {
-            if (b.left_idx == -1) {
+        if (isLeaf(i)) {
+            if (isLeaf(j)) {
                 return i > j;
             }
             return true;
         }
-        if (b.left_idx == -1) {
+        if (isLeaf(j)) {
             return false;
         }
-        auto ei = max_comp(estimate_error(a));
-        auto ej = max_comp(estimate_error(b));
+        auto ei = maxComp(estimate_error(i));
+        auto ej = maxComp(estimate_error(j));
         if (ei == ej) {
             // node with less number is higher
             return i > j;
         }
-        return ei > ej;
+        // the cluster with the largest error is refined first
+        return ei < ej;
     };
-    s.reserve(1000);
-    s.push_back(root);
+    s.reserve(budget + 1);
+    std::make_heap(s.begin(), s.end(), cmp);
+
+    while(true) {
 
-    while(s.size() < 1000) {
-        
         std::pop_heap(s.begin(), s.end(), cmp);
         int node = s.back();
-        s.pop_back();
-        if (tree[node].left_idx == -1) {
+        if (isLeaf(node)) {
             // found leaf
             break;
         }
-        auto err_est = estimate_error(tree[node]);
-        if (err_est[0] <= coeff * illumination[0] && err_est[1] <= coeff * illumination[1] && err_est[2] <= coeff * illumination[2]) {
+        auto err_est = estimate_error(node);
+        if (accurate(err_est, illumination)) {
             // got good approximation
             break;
         }
-        // if (max_comp(err_est) < 0.01 && max_comp(illumination) < 0.01f) {
-        //     // point is black and no difference would be seen
-        //     break;
-        // }
-        s.push_back(tree[node].left_idx);
+        if ((int)s.size() + 1 > budget) {
+            // refining would exceed the number of lights we can afford
+            if (budgetHit) {
+                *budgetHit = true;
+            }
+            break;
+        }
+        s.pop_back();
+        s.push_back(left[node]);
         std::push_heap(s.begin(), s.end(), cmp);
-        s.push_back(tree[node].right_idx);
+        s.push_back(right[node]);
         std::push_heap(s.begin(), s.end(), cmp);
-        if (tree[node].light_idx == tree[tree[node].left_idx].light_idx) {
-            illumination -= tree[node].light / tree[node].intensity * tree[tree[node].right_idx].intensity;
-            illumination += getLight(tree[tree[node].right_idx], position, brdf, args);
-        } else {
-            illumination -= tree[node].light * tree[tree[node].left_idx].intensity;
-            illumination += getLight(tree[tree[node].left_idx], position, brdf, args);    
-        }
+        // replace the cluster estimate by the estimates of its children, both cached for their own split
+        illumination -= getLight(node, position, brdf, args, scratch);
+        illumination += getLight(left[node], position, brdf, args, scratch);
+        illumination += getLight(right[node], position, brdf, args, scratch);
     }
-    std::vector<std::shared_ptr<PointLight>> res;
     if (print)
         std::cout << s.size();
 
     for (int idx : s) {
-        res.push_back(selectLightNode(tree[idx], true));
+        res.push_back(selectLightNode(idx, true));
     }
-    s.clear();
+    if (seedCut) {
+        *seedCut = s;
+    }
+}
+
+float LightTree::importance(int node, glm::vec3 position, const BRDF& brdf, const BRDFArgs& args) const {
+    // same bound as the cut refinement, but clamped so that clusters containing the shading point stay finite
+    float g = isDirectional(node) ? 1.0f : std::max(squaredDistance(bounds[node], position), 0.01f);
+    return maxComp(boundContribution(node, position, brdf, args, g));
+}
+
+std::vector<LightSample> LightTree::getStochasticLights(glm::vec3 position, const BRDF& brdf, const BRDFArgs& args, std::mt19937& rng, int budget, bool* budgetHit) const {
+    std::vector<LightSample> res;
+    LightCutScratch scratch;
+    getStochasticLights(position, brdf, args, rng, scratch, res, budget, budgetHit);
     return res;
-}
\ No newline at end of file
+}
+
+void LightTree::getStochasticLights(glm::vec3 position, const BRDF& brdf, const BRDFArgs& args, std::mt19937& rng, LightCutScratch& scratch, std::vector<LightSample>& res, int budget, bool* budgetHit) const {
+    if (budgetHit) {
+        *budgetHit = false;
+    }
+    if (root == -1 && dir_root == -1) {
+        return;
+    }
+    int cut_size = stochastic_cut_size;
+    if (budget > 0 && budget < cut_size) {
+        cut_size = budget;
+        if (budgetHit) {
+            *budgetHit = true;
+        }
+    }
+    // fixed size cut: always split the cluster with the largest error bound
+    std::vector<std::pair<float, int>>& cut = scratch.stochastic_cut;
+    cut.clear();
+    for (int r : {root, dir_root}) {
+        if (r != -1) {
+            cut.emplace_back(maxComp(errorBound(r, position, brdf, args)), r);
+            std::push_heap(cut.begin(), cut.end());
+        }
+    }
+    while ((int)cut.size() < cut_size) {
+        std::pop_heap(cut.begin(), cut.end());
+        int node = cut.back().second;
+        if (isLeaf(node)) {
+            // only leaves left in the cut
+            std::push_heap(cut.begin(), cut.end());
+            break;
+        }
+        cut.pop_back();
+        for (int child : {left[node], right[node]}) {
+            cut.emplace_back(maxComp(errorBound(child, position, brdf, args)), child);
+            std::push_heap(cut.begin(), cut.end());
+        }
+    }
+
+    // one light per cluster, picked by descending the tree proportionally to the children importance
+    std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+    for (auto [err, node] : cut) {
+        float pdf = 1.0f;
+        while (!isLeaf(node)) {
+            int l = left[node];
+            int r = right[node];
+            float wl = importance(l, position, brdf, args);
+            float wr = importance(r, position, brdf, args);
+            if (!(wl + wr > 0.0f)) {
+                wl = intensity[l];
+                wr = intensity[r];
+            }
+            float pl = wl / (wl + wr);
+            if (dist(rng) < pl) {
+                node = l;
+                pdf *= pl;
+            } else {
+                node = r;
+                pdf *= 1.0f - pl;
+            }
+        }
+        res.push_back(LightSample{rep_position[node], rep_color[node], intensity[node] / pdf, node, isDirectional(node), rep_normal[node]});
+    }
+}
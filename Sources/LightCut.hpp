@@ -2,36 +2,113 @@
 #include "BVH.hpp"
 #include "BRDF.hpp"
 #include "LightSource.hpp"
+#include "AlignedAllocator.hpp"
+#include <atomic>
 #include <vector>
 #include <set>
 #include <queue>
+#include <random>
 
-struct LightCutNode {
-    int left_idx = -1;
-    int right_idx = -1;
-    BoundingBox3d box;
-    int light_idx = -1;
-    float intensity = 1.0f;
-    glm::vec3 error_bound{0.0f};
-    glm::vec3 light{0.0f};
-    int last_updated = 0;
-    int last_updated_light = 0;
+/// Light chosen by a cut: the representative of a cluster, carrying the intensity of the whole cluster.
+/// For directional samples position is the unit direction towards the light.
+struct LightSample {
+    glm::vec3 position;
+    glm::vec3 color;
+    float intensity;
+    int node;
+    bool directional = false;
+    glm::vec3 normal = glm::vec3(0.0f); // see PointLight::normal
 };
 
+/// Mutable state of the cut refinement, one per rendering thread.
+struct LightCutScratch {
+    std::vector<int> heap;
+    std::vector<glm::vec3> error_bound;
+    std::vector<glm::vec3> light;
+    std::vector<int> last_updated;
+    std::vector<int> last_updated_light;
+    int timer = 0;
+    std::vector<std::pair<float, int>> stochastic_cut; // clusters of the stochastic cut, by error bound
+};
+
+/// Light tree stored as a structure of arrays: a cut traversal only pulls the arrays it reads.
 struct LightTree {
 
     LightTree() {}
 
-    void build(std::vector<std::shared_ptr<PointLight>> lights);
-    glm::vec3 getLight(LightCutNode node, glm::vec3 position, const BRDF& brdf, BRDFArgs& args);
-    std::shared_ptr<PointLight> selectLightNode(LightCutNode node, bool map_intensity, double rnd = -1);
-    std::vector<std::shared_ptr<PointLight>> getLights(glm::vec3 position, const BRDF& brdf, BRDFArgs& args, bool print = false);
+    /// Stops early, leaving an empty tree that the next sync rebuilds, once cancelled is set.
+    void build(std::vector<std::shared_ptr<PointLight>> lights, const std::atomic<bool>* cancelled = nullptr);
+    /// Brings the tree up to date with the given lights without rebuilding it: changed lights are refitted up to
+    /// the root, new ones are inserted next to the cluster they grow the least, missing ones are removed.
+    /// Rebuilds once cost() exceeds rebuild_threshold times its value after the last build. Returns true on rebuild.
+    bool sync(const std::vector<std::shared_ptr<PointLight>>& lights, const std::atomic<bool>* cancelled = nullptr);
+    /// Reads back lights[light] after it moved or changed colour/intensity.
+    void updateLight(int light);
+    int insertLight(std::shared_ptr<PointLight> light);
+    void removeLight(int light);
+    /// Clustering cost of the tree (sum of squared cluster diagonals weighted by intensity), as minimized by build.
+    double cost() const;
+    inline int size() const { return (int)intensity.size(); }
+    inline bool isLeaf(int node) const { return left[node] == -1; }
+    inline bool isDirectional(int node) const { return directional[node] != 0; }
+    /// Replaces the direction space subtree (directional lights and environment samples, world space travel
+    /// directions), built top-down by median splits so that thousands of samples stay cheap to rebuild every frame.
+    void buildDirectional(const std::vector<DirectionalLight>& lights);
 
+    glm::vec3 getLight(int node, glm::vec3 position, const BRDF& brdf, BRDFArgs& args, LightCutScratch& scratch) const;
+    LightSample selectLightNode(int node, bool map_intensity, double rnd = -1) const;
+    /// Adaptive cut, refined until every cluster error is below error_ratio of the estimate or the cut holds
+    /// min(budget, max_cut_size) lights. budgetHit is set when the cut was stopped by the budget.
+    /// A non-empty seedCut (the cut of a nearby point) is coarsened/refined instead of starting from the root;
+    /// it receives the final cut.
+    std::vector<LightSample> getLights(glm::vec3 position, const BRDF& brdf, BRDFArgs& args, LightCutScratch& scratch, int budget = -1, bool* budgetHit = nullptr, std::vector<int>* seedCut = nullptr, bool print = false) const;
+    /// Same cut appended to res, which allocates nothing once res and scratch have grown.
+    void getLights(glm::vec3 position, const BRDF& brdf, BRDFArgs& args, LightCutScratch& scratch, std::vector<LightSample>& res, int budget = -1, bool* budgetHit = nullptr, std::vector<int>* seedCut = nullptr, bool print = false) const;
+    /// Stochastic lightcuts: cut of stochastic_cut_size clusters, one light sampled per cluster by error bound.
+    /// Returned intensities are divided by the sampling pdf. Read-only, safe to call from several threads.
+    std::vector<LightSample> getStochasticLights(glm::vec3 position, const BRDF& brdf, const BRDFArgs& args, std::mt19937& rng, int budget = -1, bool* budgetHit = nullptr) const;
+    /// Same cut appended to res, the clusters being kept in scratch.
+    void getStochasticLights(glm::vec3 position, const BRDF& brdf, const BRDFArgs& args, std::mt19937& rng, LightCutScratch& scratch, std::vector<LightSample>& res, int budget = -1, bool* budgetHit = nullptr) const;
 
-    std::vector<LightCutNode> tree;
-    std::vector<std::shared_ptr<PointLight>> lights;
-    std::vector<int> s;
-    int timer = 0;
+    glm::vec3 errorBound(int node, glm::vec3 position, const BRDF& brdf, const BRDFArgs& args) const;
+    float importance(int node, glm::vec3 position, const BRDF& brdf, const BRDFArgs& args) const;
+
+    // node arrays, point and direction subtrees share them
+    AlignedVector<BoundingBox3d> bounds;
+    AlignedVector<float> intensity;
+    AlignedVector<glm::vec3> rep_position;
+    AlignedVector<glm::vec3> rep_color;
+    AlignedVector<glm::vec3> rep_normal;
+    AlignedVector<int> left;
+    AlignedVector<int> right;
+    AlignedVector<int> parent;
+    AlignedVector<int> light_idx;
+    // axis and cosine of the half angle: directions towards the lights for directional nodes, emitter normals otherwise
+    AlignedVector<glm::vec4> cone;
+    AlignedVector<unsigned char> directional;
+    int root = -1;
+    int dir_root = -1; // cuts start from both roots, so one error target covers all light types
+
+    std::vector<std::shared_ptr<PointLight>> lights; // removed lights are left as nullptr
+    std::vector<int> light_leaf;
+    std::vector<DirectionalLight> dir_lights;
+    std::vector<int> free_nodes;
+    double build_cost = 0.0;
+    float rebuild_threshold = 1.5f;
+    int agglomerative_limit = 256; // larger point light sets (VPLs) are built top-down by median splits
     bool enable_sampling = false;
     bool only_diffuse = false;
-};
\ No newline at end of file
+    int stochastic_cut_size = 0;
+    float error_ratio = 0.007f;
+    int max_cut_size = 1000;
+
+private:
+    int allocateNode();
+    int addNode(const BoundingBox3d& box, float nodeIntensity, int light, int l = -1, int r = -1);
+    void setLeaf(int node, int light);
+    void refit(int node);
+    int addDirectionalNode(int light, int l = -1, int r = -1);
+    int buildDirectional(std::vector<int>& ids, int begin, int end);
+    int buildTopDown(std::vector<int>& ids, int begin, int end);
+    glm::vec3 boundContribution(int node, glm::vec3 position, const BRDF& brdf, const BRDFArgs& args, float dist2) const;
+};
@@ -1 +1,73 @@
 #include "LightSource.hpp"
+#include "BRDF.hpp"
+#include <random>
+#include <algorithm>
+#include <stdexcept>
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+
+std::shared_ptr<EnvironmentLight> EnvironmentLight::load(const std::string& filename, float intensity, int sampleCount) {
+    int width, height, channels;
+    float* data = stbi_loadf(filename.c_str(), &width, &height, &channels, 3);
+    if (!data) {
+        throw std::runtime_error("Cannot read environment map " + filename + ": " + stbi_failure_reason());
+    }
+    auto radiance = std::make_shared<Image>(width, height);
+    for (size_t i = 0; i < (size_t)width * height; i++) {
+        (*radiance)[i] = glm::vec3(data[3 * i], data[3 * i + 1], data[3 * i + 2]);
+    }
+    stbi_image_free(data);
+    auto environment = std::make_shared<EnvironmentLight>(radiance, intensity, sampleCount);
+    // drawn here rather than by the first render thread to use them
+    environment->samples();
+    return environment;
+}
+
+glm::vec3 EnvironmentLight::direction(size_t x, size_t y) const {
+    float phi = 2.0f * PI * (x + 0.5f) / radiance->width();
+    float theta = PI * (y + 0.5f) / radiance->height();
+    return glm::vec3(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+}
+
+const std::vector<DirectionalLight>& EnvironmentLight::samples() {
+    if (!m_samples.empty() || !radiance || sampleCount <= 0) {
+        return m_samples;
+    }
+    size_t width = radiance->width();
+    size_t height = radiance->height();
+    // texel weights: luminance times the solid angle of the texel row
+    std::vector<double> cdf(width * height + 1, 0.0);
+    for (size_t y = 0; y < height; y++) {
+        float sinTheta = std::sin(PI * (y + 0.5f) / height);
+        for (size_t x = 0; x < width; x++) {
+            glm::vec3 c = (*radiance)(x, y);
+            float luminance = 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+            cdf[y * width + x + 1] = cdf[y * width + x] + std::max(luminance, 0.0f) * sinTheta;
+        }
+    }
+    double total = cdf.back();
+    if (!(total > 0.0)) {
+        return m_samples;
+    }
+    // systematic sampling of the cdf: one random offset, sampleCount evenly spaced strata
+    std::mt19937 generator(0);
+    double offset = std::uniform_real_distribution<double>(0.0, 1.0)(generator);
+    float texelSolidAngle = 2.0f * PI * PI / (width * height);
+    m_samples.reserve(sampleCount);
+    for (int i = 0; i < sampleCount; i++) {
+        double u = (i + offset) / sampleCount * total;
+        size_t texel = std::upper_bound(cdf.begin() + 1, cdf.end(), u) - cdf.begin() - 1;
+        texel = std::min(texel, width * height - 1);
+        size_t x = texel % width;
+        size_t y = texel / width;
+        float sinTheta = std::sin(PI * (y + 0.5f) / height);
+        float pdf = (cdf[texel + 1] - cdf[texel]) / total / (texelSolidAngle * sinTheta);
+        glm::vec3 value = (*radiance)(x, y) * intensity / (pdf * sampleCount);
+        float scale = std::max(value[0], std::max(value[1], value[2]));
+        if (!(scale > 0.0f)) {
+            continue;
+        }
+        m_samples.emplace_back(-direction(x, y), value / scale, scale);
+    }
+    return m_samples;
+}
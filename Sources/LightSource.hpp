@@ -3,17 +3,30 @@
 #include <glad/glad.h>
 #include "Transform.h"
 #include "Model.hpp"
+#include "Image.h"
+#include <memory>
+#include <string>
+#include <vector>
 
 
 class PointLight : public Transform {
 public:
-    PointLight(glm::vec3 position, glm::vec3 color, float intensity = 1.0f): color(color), intensity(intensity) {
+    PointLight(glm::vec3 position, glm::vec3 color, float intensity = 1.0f, glm::vec3 normal = glm::vec3(0.0f)): color(color), intensity(intensity), normal(normal) {
         setTranslation(position);
     }
     glm::vec3 color;
     float intensity;
+    glm::vec3 normal; // cosine emitter around normal, omnidirectional when zero
 };
 
+/// Emission factor of a light with the given normal towards a unit direction leaving it.
+inline float emitterCosine(glm::vec3 normal, glm::vec3 dir) {
+    if (normal == glm::vec3(0.0f)) {
+        return 1.0f;
+    }
+    return std::max(0.0f, glm::dot(normal, dir));
+}
+
 class DirectionalLight {
 public:
     DirectionalLight(glm::vec3 direction, glm::vec3 color, float intensity = 1.0f): direction(direction), color(color), intensity(intensity) {}
@@ -22,4 +35,27 @@ public:
     float intensity;
 };
 
+/// Latitude-longitude environment map (y up), lit through a fixed set of directional samples drawn proportionally
+/// to its luminance.
+class EnvironmentLight {
+public:
+    EnvironmentLight(std::shared_ptr<Image> radiance, float intensity = 1.0f, int sampleCount = 1024): radiance(radiance), intensity(intensity), sampleCount(sampleCount) {}
+    /// Reads a latitude-longitude map in any format of stb_image (Radiance .hdr for actual radiance, 8 bit formats
+    /// are linearized) and draws its samples. Throws std::runtime_error if the file cannot be read.
+    static std::shared_ptr<EnvironmentLight> load(const std::string& filename, float intensity = 1.0f, int sampleCount = 1024);
+    /// World space samples, with the travel direction of DirectionalLight. Each one carries radiance / (pdf * sampleCount),
+    /// so that summing them estimates the environment lighting. Computed on first use, call invalidate() after edits.
+    const std::vector<DirectionalLight>& samples();
+    inline void invalidate() { m_samples.clear(); }
+    /// Unit direction towards the texel centre (x, y).
+    glm::vec3 direction(size_t x, size_t y) const;
+
+    std::shared_ptr<Image> radiance;
+    float intensity;
+    int sampleCount;
+
+private:
+    std::vector<DirectionalLight> m_samples;
+};
+
 glm::vec3 GetLight(glm::vec3 l, glm::vec3 c, glm::vec3 n, glm::vec3 v, glm::vec3 albedo, float roughness);
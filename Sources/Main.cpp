@@ -34,6 +34,8 @@ namespace fs = std::filesystem;
 #include "Error.h"
 #include "Console.h"
 #include "MeshLoader.h"
+#include "MeshCleanup.hpp"
+#include "OutOfCoreGeometry.hpp"
 #include "Scene.h"
 #include "Image.h"
 #include "Rasterizer.h"
@@ -63,9 +65,16 @@ static glm::vec3 baseRot (0.0);
 // Files
 static std::string basePath;
 static std::string meshFilename;
+static std::string outOfCoreFilename; // paged geometry traced by the light cut tracers, none if empty
+static size_t outOfCoreResidentMB = 256;
+static std::shared_ptr<OutOfCoreGeometry> outOfCoreGeometryPtr;
+static std::string environmentFilename; // latitude-longitude environment map lighting the scene, none if empty
 
 // Raytraced rendering
 static int displayMode(0);
+static int overlay(0); // shown once the render is done instead of the image: 1 for adaptive sample counts, 2 for light budget hits
+static bool lightBudget(false); // frame shadow ray budget of lightBudgetPerPixel per rendered pixel
+static const long long lightBudgetPerPixel = 8;
 std::vector<std::shared_ptr<RayTracer>> rayTracers;
 
 void clear ();
@@ -83,16 +92,54 @@ void printHelp () {
    			  + "\t* F: decrease field of view\n"
    			  + "\t* G: increase field of view\n"
    			  + "\t* TAB: switch between rasterization and ray tracing display\n"
+   			  + "\t* R: toggle light cut reuse between neighbouring pixels\n"
+   			  + "\t* V: toggle indirect lighting with virtual point lights\n"
+   			  + "\t* C: toggle shadow ray visibility caching\n"
+   			  + "\t* B: toggle batched shadow rays\n"
+   			  + "\t* W: toggle the wavefront light cut pipeline\n"
+   			  + "\t* A: toggle adaptive sampling\n"
+   			  + "\t* P: toggle a light budget of " + std::to_string (lightBudgetPerPixel) + " shadow rays per pixel and frame\n"
+   			  + "\t* S: cycle the overlays shown once the render is done: adaptive sample counts, light budget hits\n"
    			  + "\t* SPACE: execute ray tracing\n");
 }
 
+/// Frame shadow ray budget of every tracer, for its render resolution, or no budget.
+void applyLightBudget () {
+	for (auto rayTracerPtr : rayTracers) {
+		size_t width, height;
+		rayTracerPtr->renderSize (width, height);
+		long long budget = lightBudget ? lightBudgetPerPixel * (long long)width * (long long)height : 0;
+		rayTracerPtr->setLightCutBudget (rayTracerPtr->lightCutsErrorRatio, rayTracerPtr->lightCutsMaxCutSize, budget);
+	}
+}
+
 /// Adjust the ray tracer target resolution and runs it.
 void raytrace () {
 	int width, height;
 	glfwGetWindowSize(windowPtr, &width, &height);
 	auto rayTracerPtr = rayTracers[std::max(0, displayMode - 1)];
+	for (auto otherPtr : rayTracers)
+		if (otherPtr != rayTracerPtr)
+			otherPtr->cancel ();
 	rayTracerPtr->setResolution (width, height);
-	rayTracerPtr->render (scenePtr);
+	applyLightBudget ();
+	rayTracerPtr->renderProgressive (scenePtr);
+}
+
+/// Stops every render and waits for its threads, before a setting they read is changed.
+void cancelRenders () {
+	for (auto rayTracerPtr : rayTracers)
+		rayTracerPtr->cancel ();
+}
+
+/// Brings the displayed ray traced image up to date after a change, once ray tracing was started with SPACE.
+/// Renders of other tracers are stopped first; a render whose inputs did not change carries on or resumes from its tiles.
+void restartRender () {
+	for (size_t i = 0; i < rayTracers.size (); i++)
+		if (displayMode != int (i) + 1)
+			rayTracers[i]->cancel ();
+	if (displayMode > 0 && rayTracers[displayMode - 1]->hasJob ())
+		rayTracers[displayMode - 1]->restart (scenePtr);
 }
 
 /// Executed each time a key is entered.
@@ -116,12 +163,53 @@ void keyCallback (GLFWwindow * windowPtr, int key, int scancode, int action, int
 			if (displayMode == -1) {
 				displayMode = rayTracers.size();
 			}
+		} else if (action == GLFW_PRESS && key == GLFW_KEY_R) {
+			cancelRenders ();
+			for (auto rayTracerPtr : rayTracers)
+				rayTracerPtr->lightCutsCoherentReuse = !rayTracerPtr->lightCutsCoherentReuse;
+			Console::print (std::string ("Light cut reuse ") + (rayTracers[0]->lightCutsCoherentReuse ? "on" : "off"));
+		} else if (action == GLFW_PRESS && key == GLFW_KEY_V) {
+			cancelRenders ();
+			for (auto rayTracerPtr : rayTracers) {
+				rayTracerPtr->vplSettings.count = rayTracerPtr->vplSettings.count > 0 ? 0 : 100000;
+				rayTracerPtr->vplSettings.clamp = 0.01f * meshScale;
+			}
+			Console::print (std::string ("Virtual point lights ") + (rayTracers[0]->vplSettings.count > 0 ? "on" : "off"));
+		} else if (action == GLFW_PRESS && key == GLFW_KEY_C) {
+			cancelRenders ();
+			for (auto rayTracerPtr : rayTracers)
+				rayTracerPtr->visibilityCaching = !rayTracerPtr->visibilityCaching;
+			Console::print (std::string ("Visibility caching ") + (rayTracers[0]->visibilityCaching ? "on" : "off"));
+		} else if (action == GLFW_PRESS && key == GLFW_KEY_B) {
+			cancelRenders ();
+			for (auto rayTracerPtr : rayTracers)
+				rayTracerPtr->batchShadowRays = !rayTracerPtr->batchShadowRays;
+			Console::print (std::string ("Batched shadow rays ") + (rayTracers[0]->batchShadowRays ? "on" : "off"));
+		} else if (action == GLFW_PRESS && key == GLFW_KEY_W) {
+			cancelRenders ();
+			for (auto rayTracerPtr : rayTracers)
+				rayTracerPtr->wavefront = !rayTracerPtr->wavefront;
+			Console::print (std::string ("Wavefront pipeline ") + (rayTracers[0]->wavefront ? "on" : "off"));
+		} else if (action == GLFW_PRESS && key == GLFW_KEY_A) {
+			cancelRenders ();
+			for (auto rayTracerPtr : rayTracers)
+				rayTracerPtr->adaptiveSampling = !rayTracerPtr->adaptiveSampling;
+			Console::print (std::string ("Adaptive sampling ") + (rayTracers[0]->adaptiveSampling ? "on" : "off"));
+		} else if (action == GLFW_PRESS && key == GLFW_KEY_P) {
+			cancelRenders ();
+			lightBudget = !lightBudget;
+			applyLightBudget ();
+			Console::print (std::string ("Light budget ") + (lightBudget ? "on" : "off"));
+		} else if (action == GLFW_PRESS && key == GLFW_KEY_S) {
+			overlay = (overlay + 1) % 3;
 		} else if (action == GLFW_PRESS && key == GLFW_KEY_SPACE) {
 			raytrace ();
+			return;
 		}
 		else {
 			printHelp ();
 		}
+		restartRender ();
 	}
 }
 
@@ -140,6 +228,9 @@ void cursorPosCallback(GLFWwindow* window, double xpos, double ypos) {
 	} else if (isZooming) {
 		scenePtr->camera()->setTranslation (baseTrans + meshScale * glm::vec3 (0.0, 0.0, dy));
 	}
+	// a render of the previous view is stale as soon as the camera moves
+	if (isRotating || isPanning || isZooming)
+		restartRender ();
 }
 
 /// Called each time a mouse button is pressed
@@ -178,6 +269,8 @@ void windowSizeCallback (GLFWwindow * windowPtr, int width, int height) {
 	for (auto rayTracerPtr : rayTracers) {
 		rayTracerPtr->setResolution (width, height);
 	}
+	applyLightBudget ();
+	restartRender ();
 }
 
 void initGLFW () {
@@ -212,33 +305,72 @@ void initGLFW () {
 	glfwSetMouseButtonCallback (windowPtr, mouseButtonCallback);
 }
 
+void printCleanupStats (const MeshCleanupStats & stats) {
+	Console::print ("Mesh cleanup: " + std::to_string (stats.weldedVertices) + " welded and " + std::to_string (stats.unusedVertices) + " unused vertices, "
+		+ std::to_string (stats.degenerateTriangles) + " degenerate and " + std::to_string (stats.duplicateTriangles) + " duplicate triangles removed, ACMR "
+		+ std::to_string (stats.acmrBefore) + " -> " + std::to_string (stats.acmrAfter));
+}
+
 void initScene () {
 	scenePtr = std::make_shared<Scene> ();
 	scenePtr->setBackgroundColor (glm::vec3 (0.0f, 0.0f, 0.0f));
 
 	// Mesh
-	auto meshPtr = std::make_shared<Mesh> ();
-	try {
-		if (meshFilename[meshFilename.size() - 1] == 'j')
-			MeshLoader::loadOBJ (meshFilename, meshPtr);
-		if (meshFilename[meshFilename.size() - 1] == 'f')
-			MeshLoader::loadOFF (meshFilename, meshPtr);
-		if (meshFilename == std::string("desk")) {
-			MeshLoader::loadOBJ("Resources/Models/desk.obj", meshPtr);
-		}
-		if (meshFilename == std::string("desk-red")) {
-			MeshLoader::loadOBJ ("Resources/Models/desk.obj", meshPtr);
+	// corners of the desk light panel, the last vertices of desk.obj: read before the cleanup renumbers the vertices
+	glm::vec3 panel[3];
+	if (meshFilename.empty ()) {
+		// rendered from the treelet file alone: nothing to rasterize, the camera is placed from the bounds of the file
+		try {
+			outOfCoreGeometryPtr = std::make_shared<OutOfCoreGeometry> (outOfCoreFilename, outOfCoreResidentMB << 20);
+		} catch (std::exception & e) {
+			exitOnCriticalError (std::string ("[Error loading out-of-core geometry]") + e.what ());
 		}
-		if (meshFilename == std::string("bedroom")) {
-			MeshLoader::loadOBJ ("Resources/Models/bedroom.obj", meshPtr);
+		BoundingBox3d bounds = outOfCoreGeometryPtr->bounds ();
+		center = 0.5f * (bounds.p1 () + bounds.p2 ());
+		meshScale = 0.5f * glm::length (bounds.p2 () - bounds.p1 ());
+	} else {
+		auto meshPtr = std::make_shared<Mesh> ();
+		auto modelPtr = std::make_shared<Model>(meshPtr, std::make_shared<Material>(glm::vec4(0.6, 0.9, 0.4, 1.0), 16, 0.2, 0.4, 0.4));
+		try {
+			if (meshFilename[meshFilename.size() - 1] == 'j')
+				MeshLoader::loadOBJ (meshFilename, meshPtr, modelPtr->ranges, modelPtr->material);
+			if (meshFilename[meshFilename.size() - 1] == 'f')
+				MeshLoader::loadOFF (meshFilename, meshPtr);
+			if (meshFilename[meshFilename.size() - 1] == 'h')
+				MeshLoader::loadBinary (meshFilename, meshPtr);
+			if (meshFilename == std::string("desk")) {
+				MeshLoader::loadOBJ("Resources/Models/desk.obj", meshPtr, modelPtr->ranges, modelPtr->material);
+			}
+			if (meshFilename == std::string("desk-red")) {
+				MeshLoader::loadOBJ ("Resources/Models/desk.obj", meshPtr, modelPtr->ranges, modelPtr->material);
+			}
+			if (meshFilename == std::string("bedroom")) {
+				MeshLoader::loadOBJ ("Resources/Models/bedroom.obj", meshPtr, modelPtr->ranges, modelPtr->material);
+			}
+			if (meshFilename == std::string("desk") || meshFilename == std::string("desk-red")) {
+				const auto & positions = meshPtr->vertexPositions ();
+				panel[0] = positions[positions.size() - 4];
+				panel[1] = positions[positions.size() - 2];
+				panel[2] = positions[positions.size() - 3];
+			}
+			// binary meshes are saved already cleaned
+			if (meshFilename[meshFilename.size() - 1] != 'h')
+				printCleanupStats (cleanupModel (*modelPtr));
+		} catch (std::exception & e) {
+			exitOnCriticalError (std::string ("[Error loading mesh]") + e.what ());
 		}
-	} catch (std::exception & e) {
-		exitOnCriticalError (std::string ("[Error loading mesh]") + e.what ());
+		meshPtr->computeBoundingSphere (center, meshScale);
+		scenePtr->add (modelPtr); 
 	}
-	meshPtr->computeBoundingSphere (center, meshScale);
-	auto modelPtr = std::make_shared<Model>(meshPtr, std::make_shared<Material>(glm::vec4(0.6, 0.9, 0.4, 1.0), 16, 0.2, 0.4, 0.4));
-	scenePtr->add (modelPtr); 
 	scenePtr->add (std::make_shared<DirectionalLight>(glm::vec3(-0.2, 0.0, -1.0), glm::vec3(1.0, 1.0, 1.0), 1.0f));
+	if (!environmentFilename.empty ()) {
+		try {
+			scenePtr->set (EnvironmentLight::load (environmentFilename));
+		} catch (std::exception & e) {
+			exitOnCriticalError (std::string ("[Error loading environment map]") + e.what ());
+		}
+		Console::print ("Environment map: " + environmentFilename + ", " + std::to_string (scenePtr->environment ()->samples ().size ()) + " samples");
+	}
 	// scenePtr->add (std::make_shared<DirectionalLight>(glm::vec3(-1.0, 1.0, 0.1), glm::vec3(1.0, 1.0, 1.0), 1.0f));
 	// scenePtr->add (std::make_shared<DirectionalLight>(glm::vec3(1.0, 0.0, 0.1), glm::vec3(1.0, 1.0, 1.0), 1.0f));
 	// std::random_device rd;  // Will be used to obtain a seed for the random number engine
@@ -258,9 +390,9 @@ void initScene () {
 
 	if (meshFilename == std::string("desk")) {
 
-		glm::vec3 p0 = meshPtr->vertexPositions()[meshPtr->vertexPositions().size() - 4];
-		glm::vec3 p1 = meshPtr->vertexPositions()[meshPtr->vertexPositions().size() - 2];
-		glm::vec3 p2 = meshPtr->vertexPositions()[meshPtr->vertexPositions().size() - 3];
+		glm::vec3 p0 = panel[0];
+		glm::vec3 p1 = panel[1];
+		glm::vec3 p2 = panel[2];
 		glm::vec3 dz = -glm::cross(p2 - p0, p1 - p0);
 		dz = glm::normalize(dz) * 0.01f;
 
@@ -280,9 +412,9 @@ void initScene () {
 	}
 	if (meshFilename == std::string("desk-red")) {
 
-		glm::vec3 p0 = meshPtr->vertexPositions()[meshPtr->vertexPositions().size() - 4];
-		glm::vec3 p1 = meshPtr->vertexPositions()[meshPtr->vertexPositions().size() - 2];
-		glm::vec3 p2 = meshPtr->vertexPositions()[meshPtr->vertexPositions().size() - 3];
+		glm::vec3 p0 = panel[0];
+		glm::vec3 p1 = panel[1];
+		glm::vec3 p2 = panel[2];
 		glm::vec3 dz = -glm::cross(p2 - p0, p1 - p0);
 		dz = glm::normalize(dz) * 0.01f;
 
@@ -318,6 +450,34 @@ void initScene () {
 	scenePtr->set (cameraPtr);
 }
 
+/// Points the light cut tracers to the paged geometry file. With a mesh, the file is written from the scene when
+/// missing or out of date; without one, it was opened by initScene.
+void initOutOfCoreGeometry () {
+	try {
+		if (!meshFilename.empty ()) {
+			if (fs::exists (outOfCoreFilename)) {
+				try {
+					outOfCoreGeometryPtr = std::make_shared<OutOfCoreGeometry> (outOfCoreFilename, outOfCoreResidentMB << 20);
+				} catch (std::runtime_error &) {
+					// another version, written again below
+				}
+			}
+			if (!outOfCoreGeometryPtr || outOfCoreGeometryPtr->contentHash () != OutOfCoreGeometry::sceneHash (scenePtr)) {
+				outOfCoreGeometryPtr.reset ();
+				OutOfCoreGeometry::write (outOfCoreFilename, scenePtr);
+				outOfCoreGeometryPtr = std::make_shared<OutOfCoreGeometry> (outOfCoreFilename, outOfCoreResidentMB << 20);
+			}
+		}
+	} catch (std::exception & e) {
+		exitOnCriticalError (std::string ("[Error loading out-of-core geometry]") + e.what ());
+	}
+	Console::print ("Out-of-core geometry: " + std::to_string (outOfCoreGeometryPtr->treeletCount ()) + " treelets, " + std::to_string (outOfCoreResidentMB) + "MB resident at most");
+	for (auto rayTracerPtr : rayTracers) {
+		rayTracerPtr->outOfCoreGeometry = outOfCoreGeometryPtr;
+		rayTracerPtr->wavefront = true;
+	}
+}
+
 void init () {
 	initGLFW (); // Windowing system
 	if (!gladLoadGLLoader ((GLADloadproc)glfwGetProcAddress)) // Load extensions for modern OpenGL
@@ -329,16 +489,22 @@ void init () {
 	// rayTracers.push_back(make_shared<RayTracer>(true, true));
 	// rayTracers.push_back(make_shared<RayTracer>(true, true, true, true));
 	// rayTracers.push_back(make_shared<RayTracer>(true, true, true));
-	rayTracers.push_back(make_shared<RayTracer>(false, false));
+	if (!meshFilename.empty ()) // without light cuts only the in-core geometry is traced, there is none with --out-of-core alone
+		rayTracers.push_back(make_shared<RayTracer>(false, false));
 	rayTracers.push_back(make_shared<RayTracer>(true, false));
 	rayTracers.push_back(make_shared<RayTracer>(true, false, false, true));
 	rayTracers.push_back(make_shared<RayTracer>(true, false, true));
+	rayTracers.push_back(make_shared<RayTracer>(true, false, false, false, 32));
 	for (auto rayTracerPtr : rayTracers) {
 		rayTracerPtr->init(scenePtr);
 	}
+	if (!outOfCoreFilename.empty ())
+		initOutOfCoreGeometry ();
 }
 
 void clear () {
+	for (auto rayTracerPtr : rayTracers)
+		rayTracerPtr->cancel ();
 	glfwDestroyWindow (windowPtr);
 	glfwTerminate ();
 }
@@ -348,9 +514,19 @@ void clear () {
 
 // The main rendering call
 void render () {
-	if (displayMode != 0)
-		rasterizerPtr->display (rayTracers[displayMode - 1]->image ());
-	else
+	static int uploadedMode = -1;
+	if (displayMode != 0 && overlay != 0 && !rayTracers[displayMode - 1]->isRendering ()) {
+		auto rayTracerPtr = rayTracers[displayMode - 1];
+		rasterizerPtr->display (overlay == 1 ? rayTracerPtr->sampleCountImage () : rayTracerPtr->budgetImage ());
+		uploadedMode = -1;
+	} else if (displayMode != 0) {
+		// only the tiles published since the previous frame go to the GPU, everything after a display switch
+		rayTracers[displayMode - 1]->publishDirty ([] (const Image & image, const RenderTile & region) {
+			rasterizerPtr->updateDisplayedImageRegion (image, region.x0, region.y0, region.x1, region.y1);
+		}, uploadedMode != displayMode);
+		uploadedMode = displayMode;
+		rasterizerPtr->displayTexture ();
+	} else
 		rasterizerPtr->render (scenePtr);
 }
 
@@ -377,12 +553,68 @@ void update (float currentTime) {
 }
 
 void usage (const char * command) {
-	Console::print ("Usage : " + std::string(command) + " [<meshfile.off>]");
+	Console::print ("Usage : " + std::string(command) + " [<meshfile.off|obj|bmesh>]");
+	Console::print ("        " + std::string(command) + " <meshfile.off|obj|bmesh> --out-of-core <geometry.treelets> [<residentMB>]");
+	Console::print ("        " + std::string(command) + " --out-of-core <geometry.treelets> [<residentMB>]");
+	Console::print ("        " + std::string(command) + " --convert <meshfile.off|obj> <meshfile.bmesh> [--quantize]");
+	Console::print ("Viewer modes also take --env <environment.hdr> anywhere, a latitude-longitude map lighting the scene");
 	std::exit (EXIT_FAILURE);
 }
 
+/// Converter mode: writes the input mesh in the binary format and exits without opening a window.
+void convertMesh (const std::string & inputFilename, const std::string & outputFilename, bool quantize) {
+	auto meshPtr = std::make_shared<Mesh> ();
+	try {
+		if (inputFilename[inputFilename.size() - 1] == 'j')
+			MeshLoader::loadOBJ (inputFilename, meshPtr);
+		else if (inputFilename[inputFilename.size() - 1] == 'f')
+			MeshLoader::loadOFF (inputFilename, meshPtr);
+		else
+			exitOnCriticalError ("[convertMesh] Unsupported input format: " + inputFilename);
+		printCleanupStats (cleanupMesh (*meshPtr));
+		MeshLoader::saveBinary (outputFilename, meshPtr, quantize);
+	} catch (std::exception & e) {
+		exitOnCriticalError (std::string ("[Error loading mesh]") + e.what ());
+	}
+	std::exit (EXIT_SUCCESS);
+}
+
 void parseCommandLine (int argc, char ** argv) {
-	if (argc > 3)
+	// --env may come anywhere in the viewer modes, it is taken out before the other arguments are read
+	std::vector<char *> args;
+	for (int i = 0; i < argc; i++) {
+		if (std::string (argv[i]) != "--env") {
+			args.push_back (argv[i]);
+			continue;
+		}
+		if (i + 1 >= argc)
+			usage (argv[0]);
+		environmentFilename = argv[++i];
+	}
+	argc = int (args.size ());
+	argv = args.data ();
+	if (argc >= 2 && std::string (argv[1]) == "--convert") {
+		if (argc < 4 || argc > 5 || (argc == 5 && std::string (argv[4]) != "--quantize"))
+			usage (argv[0]);
+		convertMesh (argv[2], argv[3], argc == 5);
+	}
+	if (argc >= 2 && std::string (argv[1]) == "--out-of-core") {
+		// no mesh: the light cut tracers render the existing treelet file on its own
+		if (argc < 3 || argc > 4 || (argc == 4 && std::atoi (argv[3]) <= 0))
+			usage (argv[0]);
+		outOfCoreFilename = argv[2];
+		if (argc == 4)
+			outOfCoreResidentMB = (size_t)std::atoi (argv[3]);
+		basePath = "./";
+		return;
+	}
+	if (argc >= 3 && std::string (argv[2]) == "--out-of-core") {
+		if (argc < 4 || argc > 5 || (argc == 5 && std::atoi (argv[4]) <= 0))
+			usage (argv[0]);
+		outOfCoreFilename = argv[3];
+		if (argc == 5)
+			outOfCoreResidentMB = (size_t)std::atoi (argv[4]);
+	} else if (argc > 3)
 		usage (argv[0]);
 	basePath = "./";
 	meshFilename = (argc >= 2 ? argv[1] : DEFAULT_MESH_FILENAME);
@@ -0,0 +1,139 @@
+#include "MappedFile.hpp"
+#include <algorithm>
+#include <ios>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string& filename, bool sequential) {
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_FLAG_RANDOM_ACCESS, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        throw std::ios_base::failure("[MappedFile] Cannot open " + filename);
+    }
+    m_file = file;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        CloseHandle(file);
+        throw std::ios_base::failure("[MappedFile] Cannot read the size of " + filename);
+    }
+    m_size = (size_t)size.QuadPart;
+    if (m_size == 0) {
+        return;
+    }
+    m_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_mapping) {
+        m_data = static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+    }
+    if (!m_data) {
+        if (m_mapping) {
+            CloseHandle(m_mapping);
+        }
+        CloseHandle(file);
+        throw std::ios_base::failure("[MappedFile] Cannot map " + filename);
+    }
+}
+
+MappedFile::~MappedFile() {
+    if (m_data) {
+        UnmapViewOfFile(m_data);
+    }
+    if (m_mapping) {
+        CloseHandle(m_mapping);
+    }
+    if (m_file) {
+        CloseHandle(m_file);
+    }
+}
+
+void MappedFile::prefetch(size_t offset, size_t size) const {
+#if _WIN32_WINNT >= 0x0602
+    if (!m_data || offset >= m_size) {
+        return;
+    }
+    WIN32_MEMORY_RANGE_ENTRY range{const_cast<char*>(m_data + offset), std::min(size, m_size - offset)};
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#endif
+}
+
+void MappedFile::release(size_t offset, size_t size) const {
+    if (!m_data || offset >= m_size) {
+        return;
+    }
+    // unlocking pages that are not locked removes them from the working set
+    VirtualUnlock(const_cast<char*>(m_data + offset), std::min(size, m_size - offset));
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& filename, bool sequential) {
+    m_fd = open(filename.c_str(), O_RDONLY);
+    if (m_fd == -1) {
+        throw std::ios_base::failure("[MappedFile] Cannot open " + filename);
+    }
+    struct stat info;
+    if (fstat(m_fd, &info) != 0) {
+        close(m_fd);
+        throw std::ios_base::failure("[MappedFile] Cannot read the size of " + filename);
+    }
+    m_size = (size_t)info.st_size;
+    if (m_size == 0) {
+        return;
+    }
+    void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+    if (data == MAP_FAILED) {
+        close(m_fd);
+        throw std::ios_base::failure("[MappedFile] Cannot map " + filename);
+    }
+    // parsed front to back, once, or paged in on demand
+    madvise(data, m_size, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+    m_data = static_cast<const char*>(data);
+}
+
+MappedFile::~MappedFile() {
+    if (m_data) {
+        munmap(const_cast<char*>(m_data), m_size);
+    }
+    if (m_fd != -1) {
+        close(m_fd);
+    }
+}
+
+namespace {
+
+/// [offset, offset + size) widened to whole pages.
+char* pageRange(const char* data, size_t fileSize, size_t offset, size_t& size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t begin = offset / page * page;
+    size = std::min(offset + size, fileSize) - begin;
+    return const_cast<char*>(data + begin);
+}
+
+}
+
+void MappedFile::prefetch(size_t offset, size_t size) const {
+    if (!m_data || offset >= m_size) {
+        return;
+    }
+    char* begin = pageRange(m_data, m_size, offset, size);
+    madvise(begin, size, MADV_WILLNEED);
+}
+
+void MappedFile::release(size_t offset, size_t size) const {
+    if (!m_data || offset >= m_size) {
+        return;
+    }
+    // the mapping is private and never written, its pages are read back from the file
+    char* begin = pageRange(m_data, m_size, offset, size);
+    madvise(begin, size, MADV_DONTNEED);
+}
+
+#endif
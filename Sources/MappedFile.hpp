@@ -0,0 +1,33 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+/// Whole file mapped read-only in memory, unmapped on destruction. Loaders parse straight from the mapping instead
+/// of going through iostreams and intermediate buffers.
+class MappedFile {
+public:
+    /// Throws std::ios_base::failure if the file cannot be opened or mapped. A file read in random order (sequential
+    /// false) gets no read-ahead beyond what prefetch asks for.
+    explicit MappedFile(const std::string& filename, bool sequential = true);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator = (const MappedFile&) = delete;
+
+    inline const char* data() const { return m_data; }
+    inline const char* end() const { return m_data + m_size; }
+    inline size_t size() const { return m_size; }
+    /// Starts reading [offset, offset + size) into memory in the background, ahead of its first access.
+    void prefetch(size_t offset, size_t size) const;
+    /// Drops the pages of [offset, offset + size) from the process memory; they are read again on their next access.
+    void release(size_t offset, size_t size) const;
+
+private:
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+#ifdef _WIN32
+    void* m_file = nullptr;
+    void* m_mapping = nullptr;
+#else
+    int m_fd = -1;
+#endif
+};
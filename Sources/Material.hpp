@@ -14,4 +14,5 @@ public:
     float kd;
     float ka;
     float ks;
+    glm::vec3 emission = glm::vec3(0.0f); // radiance emitted by the front faces
 };
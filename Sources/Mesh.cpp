@@ -12,6 +12,7 @@
 
 #include <cmath>
 #include <algorithm>
+#include <omp.h>
 
 using namespace std;
 
@@ -22,26 +23,73 @@ Mesh::~Mesh () {
 void Mesh::computeBoundingSphere (glm::vec3 & center, float & radius) const {
 	center = glm::vec3 (0.0);
 	radius = 0.f;
-	for (const auto & p : m_vertexPositions)
-		center += p;
-	center /= m_vertexPositions.size ();
-	for (const auto & p : m_vertexPositions)
-		radius = std::max (radius, distance (center, p));
+	if (m_vertexPositions.empty ())
+		return;
+	const float * P = glm::value_ptr (m_vertexPositions[0]);
+	const long long n = (long long)m_vertexPositions.size ();
+	double cx = 0.0, cy = 0.0, cz = 0.0;
+	#pragma omp parallel for simd reduction(+:cx,cy,cz) schedule(static)
+	for (long long i = 0; i < n; i++) {
+		cx += P[3 * i];
+		cy += P[3 * i + 1];
+		cz += P[3 * i + 2];
+	}
+	center = glm::vec3 (cx / n, cy / n, cz / n);
+	const float x = center[0], y = center[1], z = center[2];
+	float radius2 = 0.f;
+	#pragma omp parallel for simd reduction(max:radius2) schedule(static)
+	for (long long i = 0; i < n; i++) {
+		float dx = P[3 * i] - x, dy = P[3 * i + 1] - y, dz = P[3 * i + 2] - z;
+		radius2 = std::max (radius2, dx * dx + dy * dy + dz * dz);
+	}
+	radius = std::sqrt (radius2);
 }
 
 void Mesh::recomputePerVertexNormals (bool angleBased) {
-	m_vertexNormals.clear ();
-	// Change the following code to compute a proper per-vertex normal
-	m_vertexNormals.resize (m_vertexPositions.size (), glm::vec3 (0.0, 0.0, 0.0));
-	for (auto & t : m_triangleIndices) {
-		glm::vec3 e0 (m_vertexPositions[t[1]] - m_vertexPositions[t[0]]);
-		glm::vec3 e1 (m_vertexPositions[t[2]] - m_vertexPositions[t[0]]);
-		glm::vec3 n = normalize (cross (e0, e1));
-		for (size_t i = 0; i < 3; i++)
-			m_vertexNormals[t[i]] += n;
+	const long long vertexCount = (long long)m_vertexPositions.size ();
+	const long long triangleCount = (long long)m_triangleIndices.size ();
+	m_vertexNormals.assign (vertexCount, glm::vec3 (0.f));
+	const glm::vec3 * P = m_vertexPositions.data ();
+	const glm::uvec3 * T = m_triangleIndices.data ();
+	// Every thread scatters its static range of triangles into its own accumulator (the first one into the normals),
+	// the accumulators are then summed in thread order: the result does not depend on the scheduling.
+	std::vector<std::vector<glm::vec3>> accumulators (std::max (omp_get_max_threads () - 1, 0));
+	#pragma omp parallel
+	{
+		int thread = omp_get_thread_num ();
+		std::vector<glm::vec3> & accumulator = thread > 0 ? accumulators[thread - 1] : m_vertexNormals;
+		if (thread > 0)
+			accumulator.assign (vertexCount, glm::vec3 (0.f));
+		glm::vec3 * N = accumulator.data ();
+		#pragma omp for schedule(static)
+		for (long long t = 0; t < triangleCount; t++) {
+			const glm::uvec3 tri = T[t];
+			const glm::vec3 p0 = P[tri[0]], p1 = P[tri[1]], p2 = P[tri[2]];
+			// the unnormalized cross product is twice the area, and |e0 x e1| is the same at every corner
+			glm::vec3 n = cross (p1 - p0, p2 - p0);
+			if (angleBased) {
+				float length = glm::length (n);
+				if (length == 0.f)
+					continue;
+				N[tri[0]] += n * (std::atan2 (length, dot (p1 - p0, p2 - p0)) / length);
+				N[tri[1]] += n * (std::atan2 (length, dot (p2 - p1, p0 - p1)) / length);
+				N[tri[2]] += n * (std::atan2 (length, dot (p0 - p2, p1 - p2)) / length);
+			} else {
+				N[tri[0]] += n;
+				N[tri[1]] += n;
+				N[tri[2]] += n;
+			}
+		}
+		#pragma omp for schedule(static)
+		for (long long v = 0; v < vertexCount; v++) {
+			glm::vec3 n = m_vertexNormals[v];
+			for (const auto & other : accumulators)
+				if (!other.empty ())
+					n += other[v];
+			float length = glm::length (n);
+			m_vertexNormals[v] = length > 0.f ? n / length : glm::vec3 (0.f, 0.f, 1.f);
+		}
 	}
-	for (auto & n : m_vertexNormals)
-		n = normalize (n);
 }
 
 void Mesh::clear () {
@@ -30,6 +30,8 @@ public:
 	/// Compute the parameters of a sphere which bounds the mesh
 	void computeBoundingSphere (glm::vec3 & center, float & radius) const;
 	
+	/// Per-vertex normals as the sum of the incident face normals, weighted by the face area or, with angleBased,
+	/// by the angle of the face at the vertex. Vertices without a non-degenerate face get (0, 0, 1).
 	void recomputePerVertexNormals (bool angleBased = false);
 
 	void clear ();
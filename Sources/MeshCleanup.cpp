@@ -0,0 +1,314 @@
+#include "MeshCleanup.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+
+namespace {
+
+inline std::uint64_t hashCell(long long x, long long y, long long z) {
+    return (std::uint64_t)x * 73856093ull ^ (std::uint64_t)y * 19349663ull ^ (std::uint64_t)z * 83492791ull;
+}
+
+inline std::uint64_t hashBits(glm::vec3 p) {
+    std::uint32_t bits[3];
+    p += glm::vec3(0.f); // -0 and +0 weld
+    std::memcpy(bits, &p, sizeof(bits));
+    return hashCell(bits[0], bits[1], bits[2]);
+}
+
+/// Maps every vertex to the first earlier vertex within tolerance (itself if none). Representatives are chained per
+/// hash bucket of a grid coarser than the tolerance, so a vertex looks up its own cell and only the neighbours it
+/// lies within tolerance of.
+std::vector<unsigned int> weldVertices(const std::vector<glm::vec3>& positions, float tolerance) {
+    std::vector<unsigned int> remap(positions.size());
+    std::vector<unsigned int> next(positions.size(), UINT32_MAX);
+    std::unordered_map<std::uint64_t, unsigned int> buckets;
+    buckets.reserve(positions.size());
+    const float cellSize = 16.f * tolerance;
+    const float tolerance2 = tolerance * tolerance;
+    for (unsigned int i = 0; i < (unsigned int)positions.size(); i++) {
+        const glm::vec3& p = positions[i];
+        remap[i] = i;
+        std::uint64_t key;
+        if (tolerance == 0.f) {
+            key = hashBits(p);
+            auto bucket = buckets.find(key);
+            for (unsigned int j = bucket == buckets.end() ? UINT32_MAX : bucket->second; j != UINT32_MAX; j = next[j]) {
+                if (positions[j] == p) {
+                    remap[i] = j;
+                    break;
+                }
+            }
+        } else {
+            glm::vec3 cell = glm::floor(p / cellSize);
+            key = hashCell((long long)cell[0], (long long)cell[1], (long long)cell[2]);
+            glm::vec3 lo = glm::floor((p - tolerance) / cellSize), hi = glm::floor((p + tolerance) / cellSize);
+            for (long long x = (long long)lo[0]; x <= (long long)hi[0] && remap[i] == i; x++) {
+                for (long long y = (long long)lo[1]; y <= (long long)hi[1] && remap[i] == i; y++) {
+                    for (long long z = (long long)lo[2]; z <= (long long)hi[2] && remap[i] == i; z++) {
+                        auto bucket = buckets.find(hashCell(x, y, z));
+                        for (unsigned int j = bucket == buckets.end() ? UINT32_MAX : bucket->second; j != UINT32_MAX; j = next[j]) {
+                            glm::vec3 d = positions[j] - p;
+                            if (glm::dot(d, d) <= tolerance2) {
+                                remap[i] = j;
+                                break;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        if (remap[i] != i) {
+            continue;
+        }
+        auto inserted = buckets.emplace(key, i);
+        if (!inserted.second) {
+            next[i] = inserted.first->second;
+            inserted.first->second = i;
+        }
+    }
+    return remap;
+}
+
+/// Tipsify (Sander, Nehab and Barczak 2007): fans around the vertex that stays the longest in the cache, with a
+/// dead-end stack to restart next to the last emitted triangles. Linear in the mesh size.
+std::vector<unsigned int> tipsify(const std::vector<glm::uvec3>& triangles, size_t vertexCount, int cacheSize) {
+    std::vector<unsigned int> offsets(vertexCount + 1, 0);
+    for (const auto& t : triangles) {
+        for (int k = 0; k < 3; k++) {
+            offsets[t[k] + 1]++;
+        }
+    }
+    for (size_t v = 0; v < vertexCount; v++) {
+        offsets[v + 1] += offsets[v];
+    }
+    std::vector<unsigned int> adjacency(offsets.back());
+    std::vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+    for (unsigned int i = 0; i < (unsigned int)triangles.size(); i++) {
+        for (int k = 0; k < 3; k++) {
+            adjacency[fill[triangles[i][k]]++] = i;
+        }
+    }
+    std::vector<int> live(vertexCount);
+    for (size_t v = 0; v < vertexCount; v++) {
+        live[v] = (int)(offsets[v + 1] - offsets[v]);
+    }
+    std::vector<long long> cacheTime(vertexCount, 0);
+    std::vector<char> emitted(triangles.size(), 0);
+    std::vector<unsigned int> deadEnd, candidates, order;
+    order.reserve(triangles.size());
+    long long time = cacheSize + 1;
+    size_t cursor = 0;
+    long long fanning = vertexCount > 0 ? 0 : -1;
+    while (fanning >= 0) {
+        candidates.clear();
+        for (unsigned int a = offsets[fanning]; a < offsets[fanning + 1]; a++) {
+            unsigned int t = adjacency[a];
+            if (emitted[t]) {
+                continue;
+            }
+            emitted[t] = 1;
+            order.push_back(t);
+            for (int k = 0; k < 3; k++) {
+                unsigned int v = triangles[t][k];
+                deadEnd.push_back(v);
+                candidates.push_back(v);
+                live[v]--;
+                if (time - cacheTime[v] > cacheSize) {
+                    cacheTime[v] = time++;
+                }
+            }
+        }
+        // candidate still in the cache after its remaining triangles are fanned, the oldest one first
+        fanning = -1;
+        long long best = 0;
+        for (unsigned int v : candidates) {
+            if (live[v] <= 0) {
+                continue;
+            }
+            long long priority = 0;
+            if (time - cacheTime[v] + 2 * live[v] <= cacheSize) {
+                priority = time - cacheTime[v];
+            }
+            if (priority > best) {
+                best = priority;
+                fanning = v;
+            }
+        }
+        while (fanning < 0 && !deadEnd.empty()) {
+            unsigned int v = deadEnd.back();
+            deadEnd.pop_back();
+            if (live[v] > 0) {
+                fanning = v;
+            }
+        }
+        for (; fanning < 0 && cursor < vertexCount; cursor++) {
+            if (live[cursor] > 0) {
+                fanning = (long long)cursor;
+            }
+        }
+    }
+    return order;
+}
+
+} // namespace
+
+float averageCacheMissRatio(const std::vector<glm::uvec3>& triangles, size_t vertexCount, int cacheSize) {
+    if (triangles.empty()) {
+        return 0.f;
+    }
+    // FIFO: a vertex is cached while fewer than cacheSize misses happened since its own
+    std::vector<long long> missTime(vertexCount, -(long long)cacheSize - 1);
+    long long misses = 0;
+    for (const auto& t : triangles) {
+        for (int k = 0; k < 3; k++) {
+            if (misses - missTime[t[k]] > cacheSize) {
+                missTime[t[k]] = misses++;
+            }
+        }
+    }
+    return (float)misses / triangles.size();
+}
+
+namespace {
+
+/// cleanupMesh keeping triangles of different groups apart: groups holds the group of every triangle, triangles
+/// stay sorted by group and groups is updated along with them.
+MeshCleanupStats cleanupGroupedMesh(Mesh& mesh, std::vector<unsigned int>& groups, const MeshCleanupSettings& settings) {
+    MeshCleanupStats stats;
+    std::vector<glm::vec3>& positions = mesh.vertexPositions();
+    std::vector<glm::vec3>& normals = mesh.vertexNormals();
+    std::vector<glm::uvec3>& triangles = mesh.triangleIndices();
+    stats.acmrBefore = averageCacheMissRatio(triangles, positions.size(), settings.cacheSize);
+    if (positions.empty()) {
+        return stats;
+    }
+
+    glm::vec3 boundsMin = positions[0], boundsMax = positions[0];
+    for (const auto& p : positions) {
+        boundsMin = glm::min(boundsMin, p);
+        boundsMax = glm::max(boundsMax, p);
+    }
+    std::vector<unsigned int> remap = weldVertices(positions, settings.weldTolerance * glm::length(boundsMax - boundsMin));
+    for (unsigned int i = 0; i < (unsigned int)remap.size(); i++) {
+        stats.weldedVertices += remap[i] != i;
+    }
+
+    std::vector<glm::uvec3> kept;
+    std::vector<unsigned int> keptGroups;
+    kept.reserve(triangles.size());
+    keptGroups.reserve(triangles.size());
+    for (size_t i = 0; i < triangles.size(); i++) {
+        const glm::uvec3& t = triangles[i];
+        glm::uvec3 w(remap[t[0]], remap[t[1]], remap[t[2]]);
+        if (settings.removeDegenerate && (w[0] == w[1] || w[1] == w[2] || w[2] == w[0] || glm::cross(positions[w[1]] - positions[w[0]], positions[w[2]] - positions[w[0]]) == glm::vec3(0.f))) {
+            stats.degenerateTriangles++;
+            continue;
+        }
+        kept.push_back(w);
+        keptGroups.push_back(groups[i]);
+    }
+    if (settings.removeDuplicates) {
+        // rotated so that the smallest index comes first, which keeps the winding: two-sided geometry is not merged
+        for (auto& t : kept) {
+            int first = t[0] < t[1] ? (t[0] < t[2] ? 0 : 2) : (t[1] < t[2] ? 1 : 2);
+            t = glm::uvec3(t[first], t[(first + 1) % 3], t[(first + 2) % 3]);
+        }
+        auto less = [](const glm::uvec3& a, const glm::uvec3& b) {
+            return a[0] != b[0] ? a[0] < b[0] : a[1] != b[1] ? a[1] < b[1] : a[2] < b[2];
+        };
+        std::vector<unsigned int> sorted(kept.size());
+        for (unsigned int i = 0; i < (unsigned int)sorted.size(); i++) {
+            sorted[i] = i;
+        }
+        std::sort(sorted.begin(), sorted.end(), [&](unsigned int a, unsigned int b) {
+            return less(kept[a], kept[b]) || (kept[a] == kept[b] && (keptGroups[a] < keptGroups[b] || (keptGroups[a] == keptGroups[b] && a < b)));
+        });
+        std::vector<char> duplicate(kept.size(), 0);
+        for (size_t i = 1; i < sorted.size(); i++) {
+            duplicate[sorted[i]] = kept[sorted[i]] == kept[sorted[i - 1]] && keptGroups[sorted[i]] == keptGroups[sorted[i - 1]];
+        }
+        size_t count = 0;
+        for (size_t i = 0; i < kept.size(); i++) {
+            if (!duplicate[i]) {
+                keptGroups[count] = keptGroups[i];
+                kept[count++] = kept[i];
+            }
+        }
+        stats.duplicateTriangles = kept.size() - count;
+        kept.resize(count);
+        keptGroups.resize(count);
+    }
+
+    if (settings.reorder) {
+        // one pass over the whole mesh, then split by group keeping the order inside each group
+        std::vector<unsigned int> order = tipsify(kept, positions.size(), settings.cacheSize);
+        std::stable_sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b) { return keptGroups[a] < keptGroups[b]; });
+        std::vector<glm::uvec3> reordered(order.size());
+        std::vector<unsigned int> reorderedGroups(order.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            reordered[i] = kept[order[i]];
+            reorderedGroups[i] = keptGroups[order[i]];
+        }
+        kept.swap(reordered);
+        keptGroups.swap(reorderedGroups);
+    }
+
+    // compaction, vertices numbered in order of first use
+    std::vector<unsigned int> newIndex(positions.size(), UINT32_MAX);
+    std::vector<glm::vec3> newPositions, newNormals;
+    newPositions.reserve(positions.size() - stats.weldedVertices);
+    bool keepNormals = stats.weldedVertices == 0 && normals.size() == positions.size();
+    for (auto& t : kept) {
+        for (int k = 0; k < 3; k++) {
+            if (newIndex[t[k]] == UINT32_MAX) {
+                newIndex[t[k]] = (unsigned int)newPositions.size();
+                newPositions.push_back(positions[t[k]]);
+                if (keepNormals) {
+                    newNormals.push_back(normals[t[k]]);
+                }
+            }
+            t[k] = newIndex[t[k]];
+        }
+    }
+    stats.unusedVertices = positions.size() - stats.weldedVertices - newPositions.size();
+    positions.swap(newPositions);
+    triangles.swap(kept);
+    groups.swap(keptGroups);
+    if (keepNormals) {
+        normals.swap(newNormals);
+    } else {
+        mesh.recomputePerVertexNormals();
+    }
+    stats.acmrAfter = averageCacheMissRatio(triangles, positions.size(), settings.cacheSize);
+    return stats;
+}
+
+} // namespace
+
+MeshCleanupStats cleanupMesh(Mesh& mesh, const MeshCleanupSettings& settings) {
+    std::vector<unsigned int> groups(mesh.triangleIndices().size(), 0);
+    return cleanupGroupedMesh(mesh, groups, settings);
+}
+
+MeshCleanupStats cleanupModel(Model& model, const MeshCleanupSettings& settings) {
+    if (model.ranges.empty()) {
+        return cleanupMesh(*model.mesh, settings);
+    }
+    std::vector<unsigned int> groups(model.mesh->triangleIndices().size(), 0);
+    for (unsigned int r = 0; r < (unsigned int)model.ranges.size(); r++) {
+        std::fill(groups.begin() + model.ranges[r].first, groups.begin() + model.ranges[r].first + model.ranges[r].count, r);
+    }
+    MeshCleanupStats stats = cleanupGroupedMesh(*model.mesh, groups, settings);
+    std::vector<MaterialRange> ranges;
+    for (size_t t = 0; t < groups.size(); t++) {
+        if (ranges.empty() || groups[t] != groups[t - 1]) {
+            ranges.push_back(MaterialRange{t, 0, model.ranges[groups[t]].material});
+        }
+        ranges.back().count++;
+    }
+    model.ranges.swap(ranges);
+    return stats;
+}
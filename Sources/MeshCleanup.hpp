@@ -0,0 +1,33 @@
+#pragma once
+#include "Mesh.h"
+#include "Model.hpp"
+#include <cstddef>
+
+/// Cleanup applied to parsed meshes before the BVH and the GPU buffers are built from them.
+struct MeshCleanupSettings {
+    float weldTolerance = 1e-6f; // relative to the bounding box diagonal, 0 welds bit-identical positions only
+    bool removeDegenerate = true; // repeated vertices or zero area
+    bool removeDuplicates = true; // same vertices in the same winding
+    bool reorder = true; // Tipsify triangle order, vertices in order of first use
+    int cacheSize = 16; // vertex cache targeted by the reordering and simulated for the statistics
+};
+
+struct MeshCleanupStats {
+    size_t weldedVertices = 0;
+    size_t degenerateTriangles = 0;
+    size_t duplicateTriangles = 0;
+    size_t unusedVertices = 0;
+    float acmrBefore = 0.f; // average cache miss ratio: vertex cache misses per triangle
+    float acmrAfter = 0.f;
+};
+
+/// Welds vertices closer than the tolerance, removes degenerate and duplicate triangles, drops unused vertices and
+/// reorders triangles and vertices for the vertex cache. Normals are recomputed if vertices were welded, permuted
+/// along with the positions otherwise.
+MeshCleanupStats cleanupMesh(Mesh& mesh, const MeshCleanupSettings& settings = MeshCleanupSettings());
+/// cleanupMesh on the mesh of the model, keeping its material ranges: triangles are only reordered inside their
+/// range and duplicates are only looked for in the same range.
+MeshCleanupStats cleanupModel(Model& model, const MeshCleanupSettings& settings = MeshCleanupSettings());
+
+/// Vertex cache misses per triangle of the index buffer for a FIFO cache of cacheSize vertices.
+float averageCacheMissRatio(const std::vector<glm::uvec3>& triangles, size_t vertexCount, int cacheSize);
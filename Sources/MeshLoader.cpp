@@ -13,50 +13,418 @@
 #include <fstream>
 #include <exception>
 #include <ios>
+#include <stdexcept>
+#include <charconv>
+#include <cstring>
+#include <cstdint>
+#include <cctype>
+#include <algorithm>
+#include <unordered_map>
+#include <omp.h>
 
 #include "Console.h"
+#include "MappedFile.hpp"
 
 using namespace std;
 
+namespace {
+
+inline const char * skipBlanks (const char * p, const char * end) {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+		p++;
+	return p;
+}
+
+/// Start of the line after the one containing p.
+inline const char * nextLine (const char * p, const char * end) {
+	const char * newline = static_cast<const char *> (std::memchr (p, '\n', end - p));
+	return newline ? newline + 1 : end;
+}
+
+/// from_chars after blanks, throwing on malformed input. Returns the end of the number.
+template<typename T>
+inline const char * parseNumber (const char * p, const char * end, T & value) {
+	p = skipBlanks (p, end);
+	if (p < end && *p == '+')
+		p++;
+	auto result = std::from_chars (p, end, value);
+	if (result.ec != std::errc ())
+		throw std::runtime_error ("Malformed number");
+	return result.ptr;
+}
+
+/// Skips blanks, line breaks and # comments.
+inline const char * skipSpace (const char * p, const char * end) {
+	while (p < end) {
+		if (*p == '#')
+			p = nextLine (p, end);
+		else if (std::isspace ((unsigned char)*p))
+			p++;
+		else
+			break;
+	}
+	return p;
+}
+
+/// Polygon with the given corners appended to T as a fan around its first corner.
+template<typename Index>
+inline void addPolygon (const Index * corners, size_t count, size_t vertexCount, std::vector<glm::uvec3> & T) {
+	for (size_t j = 0; j < count; j++)
+		if (corners[j] < 0 || (size_t)corners[j] >= vertexCount)
+			throw std::runtime_error ("Vertex index out of range");
+	for (size_t j = 1; j + 1 < count; j++)
+		T.emplace_back ((unsigned int)corners[0], (unsigned int)corners[j], (unsigned int)corners[j + 1]);
+}
+
+/// Text OFF body after the header keyword: counts, the vertices (position then the extraComponents values of the
+/// header prefix, skipped), then faces as a corner count followed by the corners and an optional colour up to the
+/// end of the line.
+void parseTextOFF (const char * p, const char * end, size_t extraComponents, std::vector<glm::vec3> & P, std::vector<glm::uvec3> & T) {
+	long long sizeV, sizeF, sizeE;
+	p = parseNumber (skipSpace (p, end), end, sizeV);
+	p = parseNumber (skipSpace (p, end), end, sizeF);
+	p = parseNumber (skipSpace (p, end), end, sizeE);
+	if (sizeV < 0 || sizeF < 0)
+		throw std::runtime_error ("Negative element count");
+	P.resize ((size_t)sizeV);
+	// exact for triangle meshes, polygons add their extra triangles
+	T.reserve ((size_t)sizeF);
+	float extra;
+	for (auto & v : P) {
+		for (int k = 0; k < 3; k++)
+			p = parseNumber (skipSpace (p, end), end, v[k]);
+		for (size_t k = 0; k < extraComponents; k++)
+			p = parseNumber (skipSpace (p, end), end, extra);
+	}
+	std::vector<long long> corners;
+	for (long long i = 0; i < sizeF; i++) {
+		long long count;
+		p = parseNumber (skipSpace (p, end), end, count);
+		if (count < 0)
+			throw std::runtime_error ("Negative face size");
+		corners.resize ((size_t)count);
+		for (auto & corner : corners)
+			p = parseNumber (skipSpace (p, end), end, corner);
+		addPolygon (corners.data (), corners.size (), P.size (), T);
+		p = nextLine (p, end);
+	}
+}
+
+/// Binary OFF values are big-endian 32 bit integers and floats.
+inline std::uint32_t loadBigEndian32 (const char * p) {
+	const unsigned char * b = reinterpret_cast<const unsigned char *> (p);
+	return (std::uint32_t (b[0]) << 24) | (std::uint32_t (b[1]) << 16) | (std::uint32_t (b[2]) << 8) | std::uint32_t (b[3]);
+}
+
+/// Binary OFF body after the header line: vertex, face and edge counts, the vertices (position then the
+/// extraComponents values of the header prefix), then per face its corner count, corners, colour count and colour.
+void parseBinaryOFF (const char * p, const char * end, size_t extraComponents, std::vector<glm::vec3> & P, std::vector<glm::uvec3> & T) {
+	auto readInt = [&] () {
+		if (end - p < 4)
+			throw std::runtime_error ("Truncated binary data");
+		std::int32_t value = (std::int32_t)loadBigEndian32 (p);
+		p += 4;
+		return value;
+	};
+	std::int32_t sizeV = readInt ();
+	std::int32_t sizeF = readInt ();
+	readInt ();
+	if (sizeV < 0 || sizeF < 0)
+		throw std::runtime_error ("Negative element count");
+	size_t vertexStride = 4 * (3 + extraComponents);
+	if ((size_t)(end - p) < (size_t)sizeV * vertexStride)
+		throw std::runtime_error ("Truncated binary data");
+	P.resize ((size_t)sizeV);
+	for (std::int32_t i = 0; i < sizeV; i++, p += vertexStride)
+		for (int k = 0; k < 3; k++) {
+			std::uint32_t bits = loadBigEndian32 (p + 4 * k);
+			std::memcpy (&P[i][k], &bits, 4);
+		}
+	T.reserve ((size_t)sizeF);
+	std::vector<std::int32_t> corners;
+	for (std::int32_t i = 0; i < sizeF; i++) {
+		std::int32_t count = readInt ();
+		if (count < 0)
+			throw std::runtime_error ("Negative face size");
+		corners.resize ((size_t)count);
+		for (auto & corner : corners)
+			corner = readInt ();
+		addPolygon (corners.data (), corners.size (), P.size (), T);
+		std::int32_t colorCount = readInt ();
+		if (colorCount < 0 || end - p < 4 * (long long)colorCount)
+			throw std::runtime_error ("Truncated binary data");
+		p += 4 * (size_t)colorCount;
+	}
+}
+
+const char BINARY_MESH_MAGIC[8] = {'M', 'R', 'M', 'E', 'S', 'H', '\0', '\0'};
+const std::uint32_t BINARY_MESH_VERSION = 1;
+const std::uint32_t BINARY_MESH_QUANTIZED = 1;
+const std::uint32_t BINARY_MESH_BYTE_ORDER = 0x01020304;
+const size_t BINARY_MESH_ALIGNMENT = 64;
+
+/// Header of the binary mesh format, the arrays follow at the given offsets.
+struct BinaryMeshHeader {
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t flags;
+	std::uint32_t byteOrder; // BINARY_MESH_BYTE_ORDER as written by the saving machine
+	std::uint32_t reserved;
+	std::uint64_t vertexCount;
+	std::uint64_t triangleCount;
+	std::uint64_t positionOffset;
+	std::uint64_t normalOffset;
+	std::uint64_t indexOffset;
+	std::uint64_t contentHash; // of the three arrays as stored
+	float boundsMin[3];
+	float boundsMax[3];
+};
+
+inline size_t alignOffset (size_t offset) {
+	return (offset + BINARY_MESH_ALIGNMENT - 1) / BINARY_MESH_ALIGNMENT * BINARY_MESH_ALIGNMENT;
+}
+
+/// FNV-1a over 8 byte words (then the remaining bytes), fast enough to stay below the read bandwidth.
+std::uint64_t contentHash (const char * data, size_t size, std::uint64_t hash = 0xcbf29ce484222325ull) {
+	const std::uint64_t prime = 0x100000001b3ull;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		std::uint64_t word;
+		std::memcpy (&word, data + i, 8);
+		hash = (hash ^ word) * prime;
+	}
+	for (; i < size; i++)
+		hash = (hash ^ (unsigned char)data[i]) * prime;
+	return hash;
+}
+
+/// Octahedral mapping of a unit vector to [-1, 1]^2.
+inline glm::vec2 octahedralEncode (glm::vec3 n) {
+	n /= std::abs (n[0]) + std::abs (n[1]) + std::abs (n[2]);
+	glm::vec2 e (n[0], n[1]);
+	if (n[2] < 0.f)
+		e = (1.f - glm::abs (glm::vec2 (e[1], e[0]))) * glm::vec2 (e[0] >= 0.f ? 1.f : -1.f, e[1] >= 0.f ? 1.f : -1.f);
+	return e;
+}
+
+inline glm::vec3 octahedralDecode (glm::vec2 e) {
+	glm::vec3 n (e[0], e[1], 1.f - std::abs (e[0]) - std::abs (e[1]));
+	float t = std::max (-n[2], 0.f);
+	n[0] += n[0] >= 0.f ? -t : t;
+	n[1] += n[1] >= 0.f ? -t : t;
+	return glm::normalize (n);
+}
+
+// face indices counting back from the last vertex are stored as OBJ_RELATIVE_INDEX + index in the chunk
+const long long OBJ_RELATIVE_INDEX = 1ll << 48;
+
+/// Part of an OBJ file parsed by one thread: its vertices and its faces, indices not yet resolved.
+struct OBJChunk {
+	std::vector<glm::vec3> positions;
+	std::vector<long long> faceIndices; // position index of every face corner: absolute, or relative to the chunk
+	std::vector<int> faceSizes;
+	size_t triangleCount = 0;
+	std::vector<std::pair<size_t, std::string>> materials; // usemtl: faces of the chunk before it, material name
+	std::vector<std::string> libraries; // rest of the mtllib lines, see libraryNames
+};
+
+/// Keyword at p followed by a blank.
+inline bool isKeyword (const char * p, const char * lineEnd, const char * keyword) {
+	size_t length = std::strlen (keyword);
+	return (size_t)(lineEnd - p) > length && std::memcmp (p, keyword, length) == 0 && (p[length] == ' ' || p[length] == '\t');
+}
+
+/// Rest of the line without surrounding blanks.
+inline std::string parseName (const char * p, const char * lineEnd) {
+	p = skipBlanks (p, lineEnd);
+	while (lineEnd > p && (lineEnd[-1] == ' ' || lineEnd[-1] == '\t' || lineEnd[-1] == '\r'))
+		lineEnd--;
+	return std::string (p, lineEnd);
+}
+
+/// Files named by the rest of an mtllib line, in directory: the blank separated names, or the whole line as a
+/// single name when they do not all exist, as in "mtllib Low poly bedroom.mtl" from exporters that do not quote.
+std::vector<std::string> libraryNames (const std::string & line, const std::string & directory) {
+	std::vector<std::string> names;
+	std::istringstream stream (line);
+	for (std::string name; stream >> name;)
+		names.push_back (name);
+	for (const auto & name : names)
+		if (!std::ifstream (directory + name))
+			return std::ifstream (directory + line) ? std::vector<std::string>{line} : names;
+	return names;
+}
+
+/// Parses v, f, usemtl and mtllib lines of [p, end). Face corners may be v, v/vt, v//vn or v/vt/vn, only v is kept;
+/// normals and texture coordinates are left to recomputePerVertexNormals.
+void parseOBJChunk (const char * p, const char * end, OBJChunk & chunk) {
+	while (p < end) {
+		p = skipBlanks (p, end);
+		const char * lineEnd = static_cast<const char *> (std::memchr (p, '\n', end - p));
+		if (!lineEnd)
+			lineEnd = end;
+		if (lineEnd - p > 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+			glm::vec3 v;
+			const char * q = p + 1;
+			for (int k = 0; k < 3; k++)
+				q = parseNumber (q, lineEnd, v[k]);
+			chunk.positions.push_back (v);
+		} else if (lineEnd - p > 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+			const char * q = p + 1;
+			int faceSize = 0;
+			while (true) {
+				q = skipBlanks (q, lineEnd);
+				if (q == lineEnd)
+					break;
+				long long index;
+				q = parseNumber (q, lineEnd, index);
+				if (index == 0)
+					throw std::runtime_error ("Face index 0");
+				chunk.faceIndices.push_back (index > 0 ? index - 1 : OBJ_RELATIVE_INDEX + (long long)chunk.positions.size () + index);
+				faceSize++;
+				// texture coordinate and normal indices of the corner
+				while (q < lineEnd && *q != ' ' && *q != '\t' && *q != '\r')
+					q++;
+			}
+			if (faceSize < 3) {
+				chunk.faceIndices.resize (chunk.faceIndices.size () - faceSize);
+			} else {
+				chunk.faceSizes.push_back (faceSize);
+				chunk.triangleCount += faceSize - 2;
+			}
+		} else if (isKeyword (p, lineEnd, "usemtl")) {
+			chunk.materials.emplace_back (chunk.faceSizes.size (), parseName (p + 6, lineEnd));
+		} else if (isKeyword (p, lineEnd, "mtllib")) {
+			chunk.libraries.push_back (parseName (p + 6, lineEnd));
+		}
+		p = lineEnd == end ? end : lineEnd + 1;
+	}
+}
+
+}
+
 void MeshLoader::loadOFF (const std::string & filename, std::shared_ptr<Mesh> meshPtr) {
-	Console::print ("Start loading mesh <" + filename + ">");
-    meshPtr->clear ();
-	ifstream in (filename.c_str ());
-    if (!in) 
-        throw std::ios_base::failure ("[Mesh Loader][loadOFF] Cannot open " + filename);
-	string offString;
-    unsigned int sizeV, sizeT, tmp;
-    in >> offString >> sizeV >> sizeT >> tmp;
-    auto & P = meshPtr->vertexPositions ();
-    auto & T = meshPtr->triangleIndices ();
-    P.resize (sizeV);
-    T.resize (sizeT);
-    size_t tracker = std::max((sizeV + sizeT)/20, (unsigned)1);
-    Console::print (" > [", false);
-    for (unsigned int i = 0; i < sizeV; i++) {
-    	if (i % tracker == 0)
-    		Console::print ("-",false);
-        in >> P[i][0] >> P[i][1] >> P[i][2];
-    }
-    int s;
-    for (unsigned int i = 0; i < sizeT; i++) {
-    	if ((sizeV + i) % tracker == 0)
-    		Console::print ("-",false);
-        in >> s;
-        for (unsigned int j = 0; j < 3; j++) 
-            in >> T[i][j];
-    }
-    Console::print ("]\n", false);
-    in.close ();
-    meshPtr->vertexNormals ().resize (P.size (), glm::vec3 (0.f, 0.f, 1.f));
-    meshPtr->recomputePerVertexNormals ();
-    Console::print ("Mesh <" + filename + "> loaded");
+	meshPtr->clear ();
+	MappedFile file (filename);
+	const char * p = file.data ();
+	const char * end = file.end ();
+
+	// header keyword: [ST][C][N]OFF, optionally followed by BINARY
+	p = skipSpace (p, end);
+	const char * keyword = p;
+	while (p < end && !std::isspace ((unsigned char)*p))
+		p++;
+	std::string header (keyword, p);
+	if (header.size () < 3 || header.compare (header.size () - 3, 3, "OFF") != 0)
+		throw std::ios_base::failure ("[Mesh Loader][loadOFF] Not an OFF file: " + filename);
+	std::string prefix = header.substr (0, header.size () - 3);
+	size_t extraComponents = 0; // per vertex values after the position
+	if (prefix.compare (0, 2, "ST") == 0) {
+		extraComponents += 2;
+		prefix.erase (0, 2);
+	}
+	if (!prefix.empty () && prefix[0] == 'C') {
+		extraComponents += 4;
+		prefix.erase (0, 1);
+	}
+	if (!prefix.empty () && prefix[0] == 'N') {
+		extraComponents += 3;
+		prefix.erase (0, 1);
+	}
+	if (!prefix.empty ())
+		throw std::ios_base::failure ("[Mesh Loader][loadOFF] Unsupported OFF variant " + header + " in " + filename);
+	const char * lineEnd = static_cast<const char *> (std::memchr (p, '\n', end - p));
+	bool binary = std::search (p, lineEnd ? lineEnd : end, "BINARY", "BINARY" + 6) != (lineEnd ? lineEnd : end);
+
+	auto & P = meshPtr->vertexPositions ();
+	auto & T = meshPtr->triangleIndices ();
+	try {
+		if (binary)
+			parseBinaryOFF (lineEnd ? lineEnd + 1 : end, end, extraComponents, P, T);
+		else
+			parseTextOFF (p, end, extraComponents, P, T);
+	} catch (const std::exception & e) {
+		meshPtr->clear ();
+		throw std::runtime_error ("[Mesh Loader][loadOFF] " + std::string (e.what ()) + " in " + filename);
+	}
+	meshPtr->vertexNormals ().resize (P.size (), glm::vec3 (0.f, 0.f, 1.f));
+	meshPtr->recomputePerVertexNormals ();
+	Console::print ("Mesh <" + filename + "> loaded: " + std::to_string (P.size ()) + " vertices, " + std::to_string (T.size ()) + " triangles");
 }
 
 
 void MeshLoader::loadOBJ (const std::string & path, std::shared_ptr<Mesh> meshPtr) {
-    meshPtr->clear ();
-    if (path.size() < 4) {
+	std::vector<MaterialRange> ranges;
+	loadOBJ (path, meshPtr, ranges, nullptr);
+}
+
+void MeshLoader::loadMTL (const std::string & filename, std::unordered_map<std::string, std::shared_ptr<Material>> & materials) {
+	MappedFile file (filename);
+	const char * p = file.data ();
+	const char * end = file.end ();
+	std::shared_ptr<Material> material;
+	bool hasRoughness = false;
+	// Phong exponent to GGX roughness, unless the PBR extension gives it
+	auto finish = [&] () {
+		if (material && !hasRoughness)
+			material->roughness = std::sqrt (2.f / (material->shininess + 2.f));
+	};
+	auto parseColor = [&] (const char * q, const char * lineEnd) {
+		glm::vec3 color;
+		q = parseNumber (q, lineEnd, color[0]);
+		// a single value stands for a grey
+		if (skipBlanks (q, lineEnd) == lineEnd)
+			return glm::vec3 (color[0]);
+		q = parseNumber (q, lineEnd, color[1]);
+		parseNumber (q, lineEnd, color[2]);
+		return color;
+	};
+	auto maxComponent = [] (glm::vec3 c) { return std::max (c[0], std::max (c[1], c[2])); };
+	try {
+		while (p < end) {
+			p = skipBlanks (p, end);
+			const char * lineEnd = static_cast<const char *> (std::memchr (p, '\n', end - p));
+			if (!lineEnd)
+				lineEnd = end;
+			if (isKeyword (p, lineEnd, "newmtl")) {
+				finish ();
+				// MTL defaults: grey diffuse, no ambient, specular or emission
+				material = std::make_shared<Material> (glm::vec4 (0.8f, 0.8f, 0.8f, 1.f), 0.f, 0.f, 1.f, 0.f);
+				hasRoughness = false;
+				materials[parseName (p + 6, lineEnd)] = material;
+			} else if (material && isKeyword (p, lineEnd, "Kd")) {
+				glm::vec3 kd = parseColor (p + 2, lineEnd);
+				material->albedo = glm::vec4 (kd, material->albedo[3]);
+			} else if (material && isKeyword (p, lineEnd, "Ka")) {
+				material->ka = maxComponent (parseColor (p + 2, lineEnd));
+			} else if (material && isKeyword (p, lineEnd, "Ks")) {
+				material->ks = maxComponent (parseColor (p + 2, lineEnd));
+			} else if (material && isKeyword (p, lineEnd, "Ke")) {
+				material->emission = parseColor (p + 2, lineEnd);
+			} else if (material && isKeyword (p, lineEnd, "Ns")) {
+				parseNumber (p + 2, lineEnd, material->shininess);
+			} else if (material && isKeyword (p, lineEnd, "Pr")) {
+				parseNumber (p + 2, lineEnd, material->roughness);
+				hasRoughness = true;
+			} else if (material && isKeyword (p, lineEnd, "d")) {
+				parseNumber (p + 1, lineEnd, material->albedo[3]);
+			} else if (material && isKeyword (p, lineEnd, "Tr")) {
+				float transparency;
+				parseNumber (p + 2, lineEnd, transparency);
+				material->albedo[3] = 1.f - transparency;
+			}
+			p = lineEnd == end ? end : lineEnd + 1;
+		}
+	} catch (const std::exception & e) {
+		throw std::runtime_error ("[Mesh Loader][loadMTL] " + std::string (e.what ()) + " in " + filename);
+	}
+	finish ();
+}
+
+void MeshLoader::loadOBJ (const std::string & path, std::shared_ptr<Mesh> meshPtr, std::vector<MaterialRange> & ranges, std::shared_ptr<Material> defaultMaterial) {
+	meshPtr->clear ();
+	ranges.clear ();
+	if (path.size() < 4) {
 		throw std::invalid_argument("invalid filename");
 	}
 	size_t length = path.size();
@@ -64,52 +432,266 @@ void MeshLoader::loadOBJ (const std::string & path, std::shared_ptr<Mesh> meshPt
 	if (format != ".obj") {
 		throw std::invalid_argument("format not supported");
 	}
-	std::ifstream in(path);
-	std::string line;
+	MappedFile file (path);
+	const char * begin = file.data ();
+	const char * end = file.end ();
 
-	int surfaces;
-    std::vector<glm::vec3> vertexPositions;
-    std::vector<glm::uvec3> triangleIndices;
-	
-	while (getline(in, line)) {
-		if (line.empty()) {
-			continue;
+	// chunks start after a line break, each one is parsed by one thread into its own buffers
+	size_t chunkCount = std::max<size_t> (1, std::min<size_t> (file.size () / (1 << 20), 8 * omp_get_max_threads ()));
+	std::vector<const char *> bounds (chunkCount + 1, end);
+	bounds[0] = begin;
+	for (size_t c = 1; c < chunkCount; c++)
+		bounds[c] = std::max (bounds[c - 1], nextLine (begin + c * file.size () / chunkCount, end));
+	std::vector<OBJChunk> chunks (chunkCount);
+	std::vector<std::string> errors (chunkCount);
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (long long c = 0; c < (long long)chunkCount; c++) {
+		try {
+			parseOBJChunk (bounds[c], bounds[c + 1], chunks[c]);
+		} catch (const std::exception & e) {
+			errors[c] = e.what ();
 		}
-		if (line[0] == '#') {
-			continue;
+	}
+	for (const auto & error : errors)
+		if (!error.empty ())
+			throw std::runtime_error ("[Mesh Loader][loadOBJ] " + error + " in " + path);
+
+	// deterministic merge: chunks are laid out in file order, so that indices are the ones of a sequential parse
+	std::vector<long long> vertexOffset (chunkCount + 1, 0);
+	std::vector<size_t> triangleOffset (chunkCount + 1, 0);
+	for (size_t c = 0; c < chunkCount; c++) {
+		vertexOffset[c + 1] = vertexOffset[c] + (long long)chunks[c].positions.size ();
+		triangleOffset[c + 1] = triangleOffset[c] + chunks[c].triangleCount;
+	}
+	// material ids in order of first use, 0 for the faces before any usemtl; a chunk starts with the last one before it
+	std::vector<std::string> materialNames (1);
+	std::unordered_map<std::string, unsigned int> materialIds;
+	std::vector<std::vector<std::pair<size_t, unsigned int>>> materialSwitches (chunkCount);
+	std::vector<unsigned int> startMaterial (chunkCount + 1, 0);
+	std::vector<std::string> libraries;
+	for (size_t c = 0; c < chunkCount; c++) {
+		unsigned int current = startMaterial[c];
+		for (const auto & use : chunks[c].materials) {
+			auto inserted = materialIds.emplace (use.second, (unsigned int)materialNames.size ());
+			if (inserted.second)
+				materialNames.push_back (use.second);
+			current = inserted.first->second;
+			materialSwitches[c].emplace_back (use.first, current);
+		}
+		startMaterial[c + 1] = current;
+		for (const auto & library : chunks[c].libraries)
+			if (std::find (libraries.begin (), libraries.end (), library) == libraries.end ())
+				libraries.push_back (library);
+	}
+	auto & P = meshPtr->vertexPositions ();
+	auto & T = meshPtr->triangleIndices ();
+	P.resize ((size_t)vertexOffset[chunkCount]);
+	T.resize (triangleOffset[chunkCount]);
+	std::vector<unsigned int> triangleMaterial (T.size ());
+	long long vertexCount = vertexOffset[chunkCount];
+	std::vector<unsigned char> invalid (chunkCount, 0);
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (long long c = 0; c < (long long)chunkCount; c++) {
+		const OBJChunk & chunk = chunks[c];
+		std::copy (chunk.positions.begin (), chunk.positions.end (), P.begin () + vertexOffset[c]);
+		size_t triangle = triangleOffset[c];
+		size_t corner = 0;
+		unsigned int material = startMaterial[c];
+		auto materialSwitch = materialSwitches[c].begin ();
+		for (size_t f = 0; f < chunk.faceSizes.size (); f++) {
+			int faceSize = chunk.faceSizes[f];
+			for (; materialSwitch != materialSwitches[c].end () && materialSwitch->first <= f; materialSwitch++)
+				material = materialSwitch->second;
+			unsigned int face[3];
+			for (int j = 0; j < faceSize; j++) {
+				long long index = chunk.faceIndices[corner + j];
+				// relative indices count back from the vertices read before the face
+				if (index >= OBJ_RELATIVE_INDEX / 2)
+					index = vertexOffset[c] + index - OBJ_RELATIVE_INDEX;
+				if (index < 0 || index >= vertexCount) {
+					invalid[c] = 1;
+					index = 0;
+				}
+				// polygons are triangulated as a fan around their first corner
+				if (j < 2) {
+					face[j] = (unsigned int)index;
+					continue;
+				}
+				face[2] = (unsigned int)index;
+				triangleMaterial[triangle] = material;
+				T[triangle++] = glm::uvec3 (face[0], face[1], face[2]);
+				face[1] = face[2];
+			}
+			corner += faceSize;
 		}
-		std::istringstream iss(line);
-        std::string type;
-        iss >> type;
-        if (type != "v" && type != "f") {
-            continue;
-        }
-        if (type == "v") {
-            double a, b, c;
-            iss >> a >> b >> c;
-            vertexPositions.emplace_back(glm::vec3{a, b, c});
-        } else {
-            std::string token;
-    	 	std::vector<int> indices;
-            while (iss >> token) {
-                std::istringstream t1(token);
-                int a;
-                t1 >> a;
-                indices.emplace_back(a - 1);
-            }
-            if (indices.size() < 3) {
-                continue;
-            }
-            for (int j = 1; j + 1 < indices.size(); j++) {
-                triangleIndices.emplace_back(glm::uvec3{indices[0], indices[j], indices[j+1]});
-            }
-            triangleIndices.emplace_back(glm::uvec3{indices[0], indices[1], indices[(int)indices.size()-1]});
-        }
-    }
-
-	in.close();
-    meshPtr->vertexPositions() = vertexPositions;
-    meshPtr->triangleIndices() = triangleIndices;
-    meshPtr->vertexNormals ().resize (vertexPositions.size (), glm::vec3 (0.f, 0.f, 1.f));
-    meshPtr->recomputePerVertexNormals ();
-}
\ No newline at end of file
+	}
+	for (unsigned char bad : invalid)
+		if (bad)
+			throw std::runtime_error ("[Mesh Loader][loadOBJ] Vertex index out of range in " + path);
+
+	// libraries are looked up next to the OBJ file, unknown materials fall back to defaultMaterial
+	std::unordered_map<std::string, std::shared_ptr<Material>> libraryMaterials;
+	std::string directory = path.substr (0, path.find_last_of ("/\\") + 1);
+	for (const auto & line : libraries) {
+		for (const auto & library : libraryNames (line, directory)) {
+			try {
+				loadMTL (directory + library, libraryMaterials);
+			} catch (const std::exception & e) {
+				Console::print ("Material library <" + directory + library + "> not loaded: " + e.what ());
+			}
+		}
+	}
+	// triangles grouped by material, in order of first use and keeping their order inside a group
+	std::vector<size_t> groupSize (materialNames.size (), 0), groupStart (materialNames.size (), 0);
+	std::vector<unsigned int> groupOrder;
+	for (unsigned int material : triangleMaterial)
+		if (groupSize[material]++ == 0)
+			groupOrder.push_back (material);
+	size_t first = 0;
+	for (unsigned int material : groupOrder) {
+		size_t count = groupSize[material];
+		auto found = libraryMaterials.find (materialNames[material]);
+		if (material != 0 && found == libraryMaterials.end ())
+			Console::print ("Material <" + materialNames[material] + "> not found, using the default material");
+		ranges.push_back (MaterialRange {first, count, material != 0 && found != libraryMaterials.end () ? found->second : defaultMaterial});
+		groupStart[material] = first;
+		first += count;
+	}
+	if (ranges.size () > 1) {
+		std::vector<glm::uvec3> grouped (T.size ());
+		for (size_t t = 0; t < T.size (); t++)
+			grouped[groupStart[triangleMaterial[t]]++] = T[t];
+		T.swap (grouped);
+	}
+	meshPtr->vertexNormals ().resize (P.size (), glm::vec3 (0.f, 0.f, 1.f));
+	meshPtr->recomputePerVertexNormals ();
+	Console::print ("Mesh <" + path + "> loaded: " + std::to_string (P.size ()) + " vertices, " + std::to_string (T.size ()) + " triangles, " + std::to_string (ranges.size ()) + " materials");
+}
+
+
+void MeshLoader::saveBinary (const std::string & filename, std::shared_ptr<Mesh> meshPtr, bool quantize) {
+	const auto & P = meshPtr->vertexPositions ();
+	const auto & N = meshPtr->vertexNormals ();
+	const auto & T = meshPtr->triangleIndices ();
+	BinaryMeshHeader header {};
+	std::memcpy (header.magic, BINARY_MESH_MAGIC, 8);
+	header.version = BINARY_MESH_VERSION;
+	header.flags = quantize ? BINARY_MESH_QUANTIZED : 0;
+	header.byteOrder = BINARY_MESH_BYTE_ORDER;
+	header.vertexCount = P.size ();
+	header.triangleCount = T.size ();
+	glm::vec3 boundsMin (0.f), boundsMax (0.f);
+	if (!P.empty ()) {
+		boundsMin = boundsMax = P[0];
+		for (const auto & p : P) {
+			boundsMin = glm::min (boundsMin, p);
+			boundsMax = glm::max (boundsMax, p);
+		}
+	}
+	for (int k = 0; k < 3; k++) {
+		header.boundsMin[k] = boundsMin[k];
+		header.boundsMax[k] = boundsMax[k];
+	}
+
+	// arrays as stored, then hashed in file order
+	std::vector<char> positions, normals;
+	if (quantize) {
+		std::vector<std::uint16_t> qp (3 * P.size ());
+		std::vector<std::int16_t> qn (2 * P.size ());
+		glm::vec3 extent = glm::max (boundsMax - boundsMin, glm::vec3 (1e-30f));
+		for (size_t i = 0; i < P.size (); i++) {
+			glm::vec3 q = glm::round ((P[i] - boundsMin) / extent * 65535.f);
+			for (int k = 0; k < 3; k++)
+				qp[3 * i + k] = (std::uint16_t)glm::clamp (q[k], 0.f, 65535.f);
+			glm::vec2 e = i < N.size () ? octahedralEncode (N[i]) : glm::vec2 (0.f);
+			for (int k = 0; k < 2; k++)
+				qn[2 * i + k] = (std::int16_t)std::round (glm::clamp (e[k], -1.f, 1.f) * 32767.f);
+		}
+		positions.assign (reinterpret_cast<const char *> (qp.data ()), reinterpret_cast<const char *> (qp.data () + qp.size ()));
+		normals.assign (reinterpret_cast<const char *> (qn.data ()), reinterpret_cast<const char *> (qn.data () + qn.size ()));
+	} else {
+		std::vector<glm::vec3> fullNormals (N.begin (), N.end ());
+		fullNormals.resize (P.size (), glm::vec3 (0.f, 0.f, 1.f));
+		positions.assign (reinterpret_cast<const char *> (P.data ()), reinterpret_cast<const char *> (P.data () + P.size ()));
+		normals.assign (reinterpret_cast<const char *> (fullNormals.data ()), reinterpret_cast<const char *> (fullNormals.data () + fullNormals.size ()));
+	}
+	const char * indices = reinterpret_cast<const char *> (T.data ());
+	size_t indexBytes = T.size () * sizeof (glm::uvec3);
+	header.positionOffset = alignOffset (sizeof (BinaryMeshHeader));
+	header.normalOffset = alignOffset (header.positionOffset + positions.size ());
+	header.indexOffset = alignOffset (header.normalOffset + normals.size ());
+	header.contentHash = contentHash (indices, indexBytes, contentHash (normals.data (), normals.size (), contentHash (positions.data (), positions.size ())));
+
+	std::ofstream out (filename.c_str (), std::ios::binary);
+	if (!out)
+		throw std::ios_base::failure ("[Mesh Loader][saveBinary] Cannot open " + filename);
+	const char padding[BINARY_MESH_ALIGNMENT] = {};
+	auto writeAt = [&] (size_t offset, const char * data, size_t size) {
+		out.write (padding, (std::streamsize)(offset - (size_t)out.tellp ()));
+		out.write (data, (std::streamsize)size);
+	};
+	out.write (reinterpret_cast<const char *> (&header), sizeof (header));
+	writeAt (header.positionOffset, positions.data (), positions.size ());
+	writeAt (header.normalOffset, normals.data (), normals.size ());
+	writeAt (header.indexOffset, indices, indexBytes);
+	if (!out)
+		throw std::ios_base::failure ("[Mesh Loader][saveBinary] Cannot write " + filename);
+	Console::print ("Mesh <" + filename + "> saved: " + std::to_string (P.size ()) + " vertices, " + std::to_string (T.size ()) + " triangles" + (quantize ? ", quantized" : ""));
+}
+
+void MeshLoader::loadBinary (const std::string & filename, std::shared_ptr<Mesh> meshPtr, bool verifyHash) {
+	meshPtr->clear ();
+	MappedFile file (filename);
+	BinaryMeshHeader header;
+	if (file.size () < sizeof (header))
+		throw std::runtime_error ("[Mesh Loader][loadBinary] Truncated header in " + filename);
+	std::memcpy (&header, file.data (), sizeof (header));
+	if (std::memcmp (header.magic, BINARY_MESH_MAGIC, 8) != 0 || header.version != BINARY_MESH_VERSION)
+		throw std::runtime_error ("[Mesh Loader][loadBinary] Not a binary mesh (or another version): " + filename);
+	if (header.byteOrder != BINARY_MESH_BYTE_ORDER)
+		throw std::runtime_error ("[Mesh Loader][loadBinary] Saved with another byte order: " + filename);
+	bool quantized = (header.flags & BINARY_MESH_QUANTIZED) != 0;
+	size_t positionBytes = header.vertexCount * (quantized ? 3 * sizeof (std::uint16_t) : sizeof (glm::vec3));
+	size_t normalBytes = header.vertexCount * (quantized ? 2 * sizeof (std::int16_t) : sizeof (glm::vec3));
+	size_t indexBytes = header.triangleCount * sizeof (glm::uvec3);
+	if (header.positionOffset + positionBytes > file.size () || header.normalOffset + normalBytes > file.size () || header.indexOffset + indexBytes > file.size ())
+		throw std::runtime_error ("[Mesh Loader][loadBinary] Truncated arrays in " + filename);
+	const char * positions = file.data () + header.positionOffset;
+	const char * normals = file.data () + header.normalOffset;
+	const char * indices = file.data () + header.indexOffset;
+	if (verifyHash && contentHash (indices, indexBytes, contentHash (normals, normalBytes, contentHash (positions, positionBytes))) != header.contentHash)
+		throw std::runtime_error ("[Mesh Loader][loadBinary] Content hash mismatch in " + filename);
+
+	auto & P = meshPtr->vertexPositions ();
+	auto & N = meshPtr->vertexNormals ();
+	auto & T = meshPtr->triangleIndices ();
+	P.resize (header.vertexCount);
+	N.resize (header.vertexCount);
+	T.resize (header.triangleCount);
+	std::memcpy (T.data (), indices, indexBytes);
+	if (quantized) {
+		glm::vec3 boundsMin (header.boundsMin[0], header.boundsMin[1], header.boundsMin[2]);
+		glm::vec3 extent = glm::vec3 (header.boundsMax[0], header.boundsMax[1], header.boundsMax[2]) - boundsMin;
+		#pragma omp parallel for schedule(static)
+		for (long long i = 0; i < (long long)header.vertexCount; i++) {
+			std::uint16_t qp[3];
+			std::int16_t qn[2];
+			std::memcpy (qp, positions + 6 * i, 6);
+			std::memcpy (qn, normals + 4 * i, 4);
+			P[i] = boundsMin + glm::vec3 (qp[0], qp[1], qp[2]) / 65535.f * extent;
+			N[i] = octahedralDecode (glm::vec2 (qn[0], qn[1]) / 32767.f);
+		}
+	} else {
+		std::memcpy (P.data (), positions, positionBytes);
+		std::memcpy (N.data (), normals, normalBytes);
+	}
+	bool valid = true;
+	#pragma omp parallel for reduction(&&:valid) schedule(static)
+	for (long long i = 0; i < (long long)header.triangleCount; i++)
+		valid = valid && T[i][0] < header.vertexCount && T[i][1] < header.vertexCount && T[i][2] < header.vertexCount;
+	if (!valid) {
+		meshPtr->clear ();
+		throw std::runtime_error ("[Mesh Loader][loadBinary] Vertex index out of range in " + filename);
+	}
+	Console::print ("Mesh <" + filename + "> loaded: " + std::to_string (P.size ()) + " vertices, " + std::to_string (T.size ()) + " triangles");
+}
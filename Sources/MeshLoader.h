@@ -10,13 +10,30 @@
 
 #include <string>
 #include <memory>
+#include <vector>
+#include <unordered_map>
 
 #include "Mesh.h"
+#include "Model.hpp"
 
 namespace MeshLoader {
 
 /// Loads an OFF mesh file. See https://en.wikipedia.org/wiki/OFF_(file_format)
 void loadOFF (const std::string & filename, std::shared_ptr<Mesh> meshPtr);
 void loadOBJ (const std::string & filename, std::shared_ptr<Mesh> meshPtr);
+/// Loads an OBJ file with its material libraries: triangles are grouped by usemtl material, in order of first use,
+/// one range per material. Triangles without material or with a material missing from the libraries get
+/// defaultMaterial. Objects and groups (o, g) share the single vertex array of the file.
+void loadOBJ (const std::string & filename, std::shared_ptr<Mesh> meshPtr, std::vector<MaterialRange> & ranges, std::shared_ptr<Material> defaultMaterial);
+/// Adds the materials of a MTL file by name: Kd and d give the albedo, Ka, Ks the ka, ks weights, Ke the emission,
+/// and Ns the shininess and roughness unless Pr sets it.
+void loadMTL (const std::string & filename, std::unordered_map<std::string, std::shared_ptr<Material>> & materials);
+
+/// Loads a mesh written by saveBinary: the arrays are read from a mapping of the file in bulk, normals included, with no
+/// parsing. The content hash is checked if verifyHash is set.
+void loadBinary (const std::string & filename, std::shared_ptr<Mesh> meshPtr, bool verifyHash = true);
+/// Writes positions, normals and triangles after a header, each array 64 byte aligned. With quantize, positions are
+/// stored on 16 bits per coordinate inside the bounding box and normals as 16 bit octahedral coordinates.
+void saveBinary (const std::string & filename, std::shared_ptr<Mesh> meshPtr, bool quantize = false);
 
 }
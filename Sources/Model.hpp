@@ -3,12 +3,31 @@
 #include "Mesh.h"
 #include "Material.hpp"
 #include <memory>
+#include <vector>
+#include <algorithm>
 #include <glad/glad.h>
 
+/// Triangles [first, first + count) of a mesh drawn with one material, as grouped by the OBJ loader.
+struct MaterialRange {
+    size_t first;
+    size_t count;
+    std::shared_ptr<Material> material;
+};
+
 class Model {
 public:
     Model(std::shared_ptr<Mesh> mesh, std::shared_ptr<Material> material): mesh(mesh), material(material) {}
 
+    /// Material of a triangle of the mesh: the one of its range, material if the model has no ranges.
+    inline const std::shared_ptr<Material>& triangleMaterial(size_t triangle) const {
+        if (ranges.empty()) {
+            return material;
+        }
+        auto range = std::upper_bound(ranges.begin(), ranges.end(), triangle, [](size_t t, const MaterialRange& r) { return t < r.first; });
+        return (range == ranges.begin() ? range : range - 1)->material;
+    }
+
     std::shared_ptr<Mesh> mesh;
     std::shared_ptr<Material> material;
+    std::vector<MaterialRange> ranges; // sorted and covering the mesh, or empty
 };
\ No newline at end of file
@@ -0,0 +1,544 @@
+#include "OutOfCoreGeometry.hpp"
+#include "Console.h"
+#include <array>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace {
+
+const char TREELET_MAGIC[8] = {'M', 'R', 'T', 'R', 'E', 'E', 'S', '\0'};
+const std::uint32_t TREELET_VERSION = 2;
+const std::uint32_t TREELET_BYTE_ORDER = 0x01020304;
+// treelets start on a page, so that paging one in or out never touches its neighbours
+const size_t TREELET_PAGE_SIZE = 4096;
+
+struct TreeletFileHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byteOrder; // TREELET_BYTE_ORDER as written by the saving machine
+    std::uint32_t treeletCount;
+    std::uint32_t topNodeCount;
+    std::uint32_t materialCount;
+    std::uint32_t reserved;
+    std::uint64_t triangleCount;
+    std::uint64_t topOffset;
+    std::uint64_t directoryOffset;
+    std::uint64_t materialOffset;
+    std::uint64_t contentHash; // OutOfCoreGeometry::sceneHash of the scene written
+};
+
+/// Material as stored in the file, so that the geometry can be shaded without the scene it was written from.
+struct TreeletMaterial {
+    glm::vec4 albedo;
+    glm::vec3 emission;
+    float shininess;
+    float roughness;
+    float kd;
+    float ka;
+    float ks;
+};
+
+/// Triangle of the scene while it is cut into treelets: where to read it from, and where it is.
+struct TriangleReference {
+    glm::vec3 centroid;
+    int mesh;
+    int prim;
+};
+
+/// FNV-1a, continued from hash.
+std::uint64_t hashBytes(std::uint64_t hash, const void* data, size_t size) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+template<typename T>
+inline std::uint64_t hashVector(std::uint64_t hash, const std::vector<T>& values) {
+    std::uint64_t size = values.size();
+    hash = hashBytes(hash, &size, sizeof(size));
+    return hashBytes(hash, values.data(), values.size() * sizeof(T));
+}
+
+/// Distinct materials of the models then of their ranges, in the order the file numbers them.
+std::vector<std::shared_ptr<Material>> sceneMaterials(const std::shared_ptr<Scene> scenePtr, std::unordered_map<const Material*, int>& materialIndex) {
+    std::vector<std::shared_ptr<Material>> materials;
+    auto addMaterial = [&](const std::shared_ptr<Material>& material) {
+        if (materialIndex.emplace(material.get(), (int)materials.size()).second) {
+            materials.push_back(material);
+        }
+    };
+    for (size_t i = 0; i < scenePtr->numOfMeshes(); i++) {
+        const auto& model = scenePtr->mesh(i);
+        addMaterial(model->material);
+        for (const auto& range : model->ranges) {
+            addMaterial(range.material);
+        }
+    }
+    return materials;
+}
+
+TreeletMaterial storedMaterial(const Material& material) {
+    return TreeletMaterial{material.albedo, material.emission, material.shininess, material.roughness, material.kd, material.ka, material.ks};
+}
+
+inline size_t alignPage(size_t offset) {
+    return (offset + TREELET_PAGE_SIZE - 1) / TREELET_PAGE_SIZE * TREELET_PAGE_SIZE;
+}
+
+BoundingBox3d triangleBounds(const std::shared_ptr<Scene>& scenePtr, const TriangleReference& reference) {
+    const auto& mesh = *scenePtr->mesh(reference.mesh)->mesh;
+    const glm::uvec3& triangle = mesh.triangleIndices()[reference.prim];
+    const glm::vec3& p = mesh.vertexPositions()[triangle[0]];
+    BoundingBox3d box{p.x, p.x, p.y, p.y, p.z, p.z};
+    box.update(mesh.vertexPositions()[triangle[1]]);
+    box.update(mesh.vertexPositions()[triangle[2]]);
+    return box;
+}
+
+/// Entry distance of the ray into the box, as BoundingBox3d::hasIntersection(ray, tMax) decides it. False if missed.
+inline bool boxEntry(const BoundingBox3d& box, const Ray& ray, float tMax, float& entry) {
+    float tx1 = (box.x_min - ray.origin.x) / ray.direction.x, tx2 = (box.x_max - ray.origin.x) / ray.direction.x;
+    float tmin = std::min(tx1, tx2), tmax = std::max(tx1, tx2);
+    float ty1 = (box.y_min - ray.origin.y) / ray.direction.y, ty2 = (box.y_max - ray.origin.y) / ray.direction.y;
+    tmin = std::max(tmin, std::min(ty1, ty2)), tmax = std::min(tmax, std::max(ty1, ty2));
+    float tz1 = (box.z_min - ray.origin.z) / ray.direction.z, tz2 = (box.z_max - ray.origin.z) / ray.direction.z;
+    tmin = std::max(tmin, std::min(tz1, tz2)), tmax = std::min(tmax, std::max(tz1, tz2));
+    entry = std::max(tmin, 0.0f);
+    return tmax >= tmin && tmax > 0 && tmin < tMax;
+}
+
+/// Treelets whose box the ray enters before tMax, in top-level tree order. Only counts them if treelet is null.
+size_t enterTreelets(const std::vector<TreeletTopNode>& top, const Ray& ray, float tMax, float* entryT, int* treelet) {
+    size_t count = 0;
+    if (top.empty()) {
+        return count;
+    }
+    int stack[64];
+    int size = 0;
+    stack[size++] = 0;
+    while (size > 0) {
+        const TreeletTopNode& node = top[stack[--size]];
+        float entry;
+        if (!boxEntry(node.box, ray, tMax, entry)) {
+            continue;
+        }
+        if (node.treelet != -1) {
+            if (treelet) {
+                entryT[count] = entry;
+                treelet[count] = node.treelet;
+            }
+            count++;
+            continue;
+        }
+        stack[size++] = node.right;
+        stack[size++] = node.left;
+    }
+    return count;
+}
+
+/// Closest triangle of the treelet hit before bestT, same tests as SceneGeometry::closestHit.
+void closestInTreelet(const Node* nodes, const TreeletTriangle* triangles, const Ray& ray, float& bestT, const TreeletTriangle*& best, glm::vec2& bestBarycentrics) {
+    int stack[64];
+    int size = 0;
+    stack[size++] = 0;
+    while (size > 0) {
+        const Node& node = nodes[stack[--size]];
+        if (!node.box.hasIntersection(ray, bestT)) {
+            continue;
+        }
+        if (node.block_size <= 2) {
+            for (int i = node.block_start; i < node.block_start + node.block_size; i++) {
+                const TreeletTriangle& triangle = triangles[i];
+                float t;
+                glm::vec2 barycentrics;
+                if (rayTriangleIntersect(ray, triangle.position[0], triangle.position[1], triangle.position[2], t, barycentrics) && t < bestT) {
+                    bestT = t;
+                    best = &triangle;
+                    bestBarycentrics = barycentrics;
+                }
+            }
+            continue;
+        }
+        stack[size++] = node.right_idx;
+        stack[size++] = node.left_idx;
+    }
+}
+
+/// True if a triangle of the treelet lies on the ray before maxT, same tests as SceneGeometry::occluded.
+bool anyInTreelet(const Node* nodes, const TreeletTriangle* triangles, const Ray& ray, float maxT) {
+    int stack[64];
+    int size = 0;
+    stack[size++] = 0;
+    while (size > 0) {
+        const Node& node = nodes[stack[--size]];
+        if (!node.box.hasIntersection(ray, maxT)) {
+            continue;
+        }
+        if (node.block_size <= 2) {
+            for (int i = node.block_start; i < node.block_start + node.block_size; i++) {
+                const TreeletTriangle& triangle = triangles[i];
+                float t;
+                if (rayTriangleIntersect(ray, triangle.position[0], triangle.position[1], triangle.position[2], t) && t < maxT) {
+                    return true;
+                }
+            }
+            continue;
+        }
+        stack[size++] = node.right_idx;
+        stack[size++] = node.left_idx;
+    }
+    return false;
+}
+
+/// Median split on the longest axis of the triangle bounds, down to treelets of at most treeletTriangles.
+/// Returns the top-level node of triangles[begin, end).
+int partitionTreelets(const std::shared_ptr<Scene>& scenePtr, std::vector<TriangleReference>& triangles, size_t begin, size_t end, size_t treeletTriangles, std::vector<TreeletTopNode>& top, std::vector<std::pair<size_t, size_t>>& treelets) {
+    TreeletTopNode node;
+    node.box = triangleBounds(scenePtr, triangles[begin]);
+    for (size_t i = begin + 1; i < end; i++) {
+        node.box.update(triangleBounds(scenePtr, triangles[i]));
+    }
+    int index = (int)top.size();
+    top.push_back(node);
+    if (end - begin <= treeletTriangles) {
+        top[index].treelet = (int)treelets.size();
+        treelets.emplace_back(begin, end);
+        return index;
+    }
+    int axis = node.box.longest_axis();
+    size_t middle = begin + (end - begin) / 2;
+    std::nth_element(triangles.begin() + begin, triangles.begin() + middle, triangles.begin() + end, [&](const TriangleReference& a, const TriangleReference& b) {
+        return a.centroid[axis] < b.centroid[axis];
+    });
+    int left = partitionTreelets(scenePtr, triangles, begin, middle, treeletTriangles, top, treelets);
+    int right = partitionTreelets(scenePtr, triangles, middle, end, treeletTriangles, top, treelets);
+    top[index].left = left;
+    top[index].right = right;
+    return index;
+}
+
+}
+
+std::uint64_t OutOfCoreGeometry::sceneHash(const std::shared_ptr<Scene> scenePtr) {
+    std::unordered_map<const Material*, int> materialIndex;
+    std::vector<std::shared_ptr<Material>> materials = sceneMaterials(scenePtr, materialIndex);
+    std::uint64_t hash = 0xcbf29ce484222325ull;
+    for (const auto& material : materials) {
+        TreeletMaterial stored = storedMaterial(*material);
+        hash = hashBytes(hash, &stored, sizeof(stored));
+    }
+    for (size_t i = 0; i < scenePtr->numOfMeshes(); i++) {
+        const auto& model = scenePtr->mesh(i);
+        hash = hashVector(hash, model->mesh->vertexPositions());
+        hash = hashVector(hash, model->mesh->vertexNormals());
+        hash = hashVector(hash, model->mesh->triangleIndices());
+        std::int64_t range[3] = {-1, -1, materialIndex[model->material.get()]};
+        hash = hashBytes(hash, range, sizeof(range));
+        for (const auto& materialRange : model->ranges) {
+            range[0] = (std::int64_t)materialRange.first;
+            range[1] = (std::int64_t)materialRange.count;
+            range[2] = materialIndex[materialRange.material.get()];
+            hash = hashBytes(hash, range, sizeof(range));
+        }
+    }
+    return hash;
+}
+
+void OutOfCoreGeometry::write(const std::string& filename, const std::shared_ptr<Scene> scenePtr, size_t treeletTriangles) {
+    treeletTriangles = std::max(treeletTriangles, size_t(1));
+    std::unordered_map<const Material*, int> materialIndex;
+    std::vector<std::shared_ptr<Material>> materials = sceneMaterials(scenePtr, materialIndex);
+    // only where each triangle is: the treelets are filled from the meshes one at a time
+    std::vector<TriangleReference> triangles;
+    size_t triangleCount = 0;
+    for (size_t i = 0; i < scenePtr->numOfMeshes(); i++) {
+        triangleCount += scenePtr->mesh(i)->mesh->triangleIndices().size();
+    }
+    triangles.reserve(triangleCount);
+    for (int i = 0; i < (int)scenePtr->numOfMeshes(); i++) {
+        const auto& positions = scenePtr->mesh(i)->mesh->vertexPositions();
+        const auto& indices = scenePtr->mesh(i)->mesh->triangleIndices();
+        for (int j = 0; j < (int)indices.size(); j++) {
+            glm::vec3 centroid = (positions[indices[j][0]] + positions[indices[j][1]] + positions[indices[j][2]]) / 3.0f;
+            triangles.push_back(TriangleReference{centroid, i, j});
+        }
+    }
+
+    std::vector<TreeletTopNode> top;
+    std::vector<std::pair<size_t, size_t>> ranges;
+    if (!triangles.empty()) {
+        partitionTreelets(scenePtr, triangles, 0, triangles.size(), treeletTriangles, top, ranges);
+    }
+
+    TreeletFileHeader header{};
+    std::memcpy(header.magic, TREELET_MAGIC, 8);
+    header.version = TREELET_VERSION;
+    header.byteOrder = TREELET_BYTE_ORDER;
+    header.treeletCount = (std::uint32_t)ranges.size();
+    header.topNodeCount = (std::uint32_t)top.size();
+    header.materialCount = (std::uint32_t)materials.size();
+    header.triangleCount = triangles.size();
+    header.topOffset = sizeof(TreeletFileHeader);
+    header.directoryOffset = header.topOffset + top.size() * sizeof(TreeletTopNode);
+    header.materialOffset = header.directoryOffset + ranges.size() * sizeof(TreeletEntry);
+    header.contentHash = sceneHash(scenePtr);
+    std::vector<TreeletEntry> directory(ranges.size());
+    std::vector<TreeletMaterial> storedMaterials;
+    for (const auto& material : materials) {
+        storedMaterials.push_back(storedMaterial(*material));
+    }
+
+    std::ofstream out(filename.c_str(), std::ios::binary);
+    if (!out) {
+        throw std::ios_base::failure("[OutOfCoreGeometry] Cannot open " + filename);
+    }
+    // treelets first, one at a time, then the header and the tables in front of them
+    size_t offset = alignPage(header.materialOffset + storedMaterials.size() * sizeof(TreeletMaterial));
+    for (size_t t = 0; t < ranges.size(); t++) {
+        std::vector<std::array<glm::vec3, 3>> primitives;
+        primitives.reserve(ranges[t].second - ranges[t].first);
+        for (size_t i = ranges[t].first; i < ranges[t].second; i++) {
+            const auto& mesh = *scenePtr->mesh(triangles[i].mesh)->mesh;
+            const glm::uvec3& triangle = mesh.triangleIndices()[triangles[i].prim];
+            primitives.push_back({mesh.vertexPositions()[triangle[0]], mesh.vertexPositions()[triangle[1]], mesh.vertexPositions()[triangle[2]]});
+        }
+        BVH<std::array<glm::vec3, 3>> bvh(std::move(primitives));
+        bvh.build();
+        // triangles in leaf order, the nodes index them directly
+        std::vector<TreeletTriangle> local(bvh.indices.size());
+        for (size_t i = 0; i < local.size(); i++) {
+            const TriangleReference& reference = triangles[ranges[t].first + bvh.indices[i]];
+            const Model& model = *scenePtr->mesh(reference.mesh);
+            const glm::uvec3& triangle = model.mesh->triangleIndices()[reference.prim];
+            for (int k = 0; k < 3; k++) {
+                local[i].position[k] = model.mesh->vertexPositions()[triangle[k]];
+                local[i].normal[k] = model.mesh->vertexNormals()[triangle[k]];
+            }
+            local[i].material = materialIndex[model.triangleMaterial(reference.prim).get()];
+            local[i].mesh = reference.mesh;
+            local[i].prim = reference.prim;
+        }
+        TreeletEntry& entry = directory[t];
+        entry.offset = offset;
+        entry.nodeCount = (std::uint32_t)bvh.tree.size();
+        entry.triangleCount = (std::uint32_t)local.size();
+        entry.bytes = bvh.tree.size() * sizeof(Node) + local.size() * sizeof(TreeletTriangle);
+        out.seekp((std::streamoff)offset);
+        out.write(reinterpret_cast<const char*>(bvh.tree.data()), (std::streamsize)(bvh.tree.size() * sizeof(Node)));
+        out.write(reinterpret_cast<const char*>(local.data()), (std::streamsize)(local.size() * sizeof(TreeletTriangle)));
+        offset = alignPage(offset + entry.bytes);
+    }
+    for (const auto& node : top) {
+        if (node.treelet != -1) {
+            directory[node.treelet].box = node.box;
+        }
+    }
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(top.data()), (std::streamsize)(top.size() * sizeof(TreeletTopNode)));
+    out.write(reinterpret_cast<const char*>(directory.data()), (std::streamsize)(directory.size() * sizeof(TreeletEntry)));
+    out.write(reinterpret_cast<const char*>(storedMaterials.data()), (std::streamsize)(storedMaterials.size() * sizeof(TreeletMaterial)));
+    if (!out) {
+        throw std::ios_base::failure("[OutOfCoreGeometry] Cannot write " + filename);
+    }
+    Console::print("Geometry <" + filename + "> saved: " + std::to_string(triangles.size()) + " triangles in " + std::to_string(ranges.size()) + " treelets");
+}
+
+OutOfCoreGeometry::OutOfCoreGeometry(const std::string& filename, size_t residentBytes):
+    residentBudget(residentBytes), m_file(filename, false) {
+    TreeletFileHeader header;
+    if (m_file.size() < sizeof(header)) {
+        throw std::runtime_error("[OutOfCoreGeometry] Truncated header in " + filename);
+    }
+    std::memcpy(&header, m_file.data(), sizeof(header));
+    if (std::memcmp(header.magic, TREELET_MAGIC, 8) != 0 || header.version != TREELET_VERSION) {
+        throw std::runtime_error("[OutOfCoreGeometry] Not a treelet file (or another version): " + filename);
+    }
+    if (header.byteOrder != TREELET_BYTE_ORDER) {
+        throw std::runtime_error("[OutOfCoreGeometry] Saved with another byte order: " + filename);
+    }
+    if (header.topOffset + header.topNodeCount * sizeof(TreeletTopNode) > m_file.size() || header.directoryOffset + header.treeletCount * sizeof(TreeletEntry) > m_file.size()
+        || header.materialOffset + header.materialCount * sizeof(TreeletMaterial) > m_file.size()) {
+        throw std::runtime_error("[OutOfCoreGeometry] Truncated tables in " + filename);
+    }
+    m_top.resize(header.topNodeCount);
+    m_treelets.resize(header.treeletCount);
+    std::memcpy(m_top.data(), m_file.data() + header.topOffset, m_top.size() * sizeof(TreeletTopNode));
+    std::memcpy(m_treelets.data(), m_file.data() + header.directoryOffset, m_treelets.size() * sizeof(TreeletEntry));
+    for (const auto& entry : m_treelets) {
+        if (entry.bytes != entry.nodeCount * sizeof(Node) + entry.triangleCount * sizeof(TreeletTriangle) || entry.offset + entry.bytes > m_file.size()) {
+            throw std::runtime_error("[OutOfCoreGeometry] Truncated treelet in " + filename);
+        }
+    }
+    const TreeletMaterial* materials = reinterpret_cast<const TreeletMaterial*>(m_file.data() + header.materialOffset);
+    for (std::uint32_t i = 0; i < header.materialCount; i++) {
+        auto material = std::make_shared<Material>(materials[i].albedo, materials[i].shininess, materials[i].ka, materials[i].kd, materials[i].ks);
+        material->roughness = materials[i].roughness;
+        material->emission = materials[i].emission;
+        m_materials.push_back(material);
+    }
+    m_triangleCount = header.triangleCount;
+    m_contentHash = header.contentHash;
+    m_resident.assign(m_treelets.size(), 0);
+    m_lruPosition.resize(m_treelets.size());
+    m_queues.resize(m_treelets.size());
+    // the tables were copied, the treelets are read when a ray first waits on them
+    m_file.release(0, m_file.size());
+}
+
+void OutOfCoreGeometry::makeResident(int treelet) {
+    if (m_resident[treelet]) {
+        m_lru.splice(m_lru.begin(), m_lru, m_lruPosition[treelet]);
+        return;
+    }
+    const TreeletEntry& entry = m_treelets[treelet];
+    while (m_residentBytes + entry.bytes > residentBudget && !m_lru.empty()) {
+        evict(m_lru.back());
+    }
+    m_file.prefetch(entry.offset, entry.bytes);
+    m_lru.push_front(treelet);
+    m_lruPosition[treelet] = m_lru.begin();
+    m_resident[treelet] = 1;
+    m_residentBytes += entry.bytes;
+    peakResidentBytes = std::max(peakResidentBytes, m_residentBytes);
+    treeletLoads++;
+}
+
+void OutOfCoreGeometry::evict(int treelet) {
+    const TreeletEntry& entry = m_treelets[treelet];
+    m_file.release(entry.offset, entry.bytes);
+    m_lru.erase(m_lruPosition[treelet]);
+    m_resident[treelet] = 0;
+    m_residentBytes -= entry.bytes;
+    treeletEvictions++;
+}
+
+template<typename Trace>
+void OutOfCoreGeometry::traceBatch(const AlignedVector<glm::vec3>& origin, const AlignedVector<glm::vec3>& direction, const AlignedVector<float>& maxT, const Trace& trace) {
+    long long n = (long long)origin.size();
+    m_normalized.resize(n);
+    m_firstEntry.assign(n + 1, 0);
+    m_cursor.resize(n);
+
+    // treelets entered by each ray, counted then listed nearest first
+    #pragma omp parallel for schedule(dynamic, 256)
+    for (long long i = 0; i < n; i++) {
+        m_normalized[i] = Ray{origin[i], direction[i]};
+        m_normalized[i].normalize();
+        m_firstEntry[i + 1] = maxT[i] < 0 ? 0 : enterTreelets(m_top, m_normalized[i], maxT[i], nullptr, nullptr);
+    }
+    for (long long i = 0; i < n; i++) {
+        m_firstEntry[i + 1] += m_firstEntry[i];
+    }
+    m_entryT.resize(m_firstEntry[n]);
+    m_entryTreelet.resize(m_firstEntry[n]);
+    #pragma omp parallel for schedule(dynamic, 256)
+    for (long long i = 0; i < n; i++) {
+        if (m_firstEntry[i] == m_firstEntry[i + 1]) {
+            continue;
+        }
+        float* entryT = m_entryT.data() + m_firstEntry[i];
+        int* treelet = m_entryTreelet.data() + m_firstEntry[i];
+        size_t count = enterTreelets(m_top, m_normalized[i], maxT[i], entryT, treelet);
+        // a handful of treelets per ray, insertion sort
+        for (size_t j = 1; j < count; j++) {
+            for (size_t k = j; k > 0 && entryT[k] < entryT[k - 1]; k--) {
+                std::swap(entryT[k], entryT[k - 1]);
+                std::swap(treelet[k], treelet[k - 1]);
+            }
+        }
+    }
+    for (long long i = 0; i < n; i++) {
+        m_cursor[i] = m_firstEntry[i];
+        if (m_firstEntry[i] != m_firstEntry[i + 1]) {
+            m_queues[m_entryTreelet[m_firstEntry[i]]].push_back((unsigned int)i);
+        }
+    }
+
+    std::vector<float> limit(maxT.begin(), maxT.end());
+    while (true) {
+        // resident treelets first, then the one most rays wait on
+        int treelet = -1;
+        for (int t = 0; t < (int)m_queues.size(); t++) {
+            if (m_queues[t].empty()) {
+                continue;
+            }
+            if (treelet == -1 || m_resident[t] > m_resident[treelet] || (m_resident[t] == m_resident[treelet] && m_queues[t].size() > m_queues[treelet].size())) {
+                treelet = t;
+            }
+        }
+        if (treelet == -1) {
+            break;
+        }
+        m_rays.swap(m_queues[treelet]);
+        m_queues[treelet].clear();
+        makeResident(treelet);
+        long long count = (long long)m_rays.size();
+        m_next.resize(count);
+        #pragma omp parallel for schedule(dynamic, 64)
+        for (long long k = 0; k < count; k++) {
+            unsigned int i = m_rays[k];
+            limit[i] = trace(i, treelet, limit[i]);
+            size_t next = ++m_cursor[i];
+            // treelets entered beyond the current limit cannot hold anything nearer
+            m_next[k] = limit[i] >= 0 && next < m_firstEntry[i + 1] && m_entryT[next] <= limit[i] ? m_entryTreelet[next] : -1;
+        }
+        for (long long k = 0; k < count; k++) {
+            if (m_next[k] != -1) {
+                m_queues[m_next[k]].push_back(m_rays[k]);
+            }
+        }
+    }
+}
+
+void OutOfCoreGeometry::closestHits(const AlignedVector<glm::vec3>& origin, const AlignedVector<glm::vec3>& direction, AlignedVector<float>& t, AlignedVector<glm::vec3>& normal, AlignedVector<int>& material) {
+    size_t n = origin.size();
+    m_hitT.assign(n, -1.0f);
+    m_hitNormal.resize(n);
+    m_hitMaterial.resize(n);
+    AlignedVector<float> maxT(n, std::numeric_limits<float>::infinity());
+    traceBatch(origin, direction, maxT, [&](unsigned int i, int treelet, float bestT) {
+        const TreeletTriangle* best = nullptr;
+        glm::vec2 barycentrics;
+        closestInTreelet(treeletNodes(treelet), treeletTriangles(treelet), m_normalized[i], bestT, best, barycentrics);
+        if (best) {
+            // shaded now, the treelet may be gone once the ray is done
+            glm::vec3 uvw(1.0f - barycentrics[0] - barycentrics[1], barycentrics[0], barycentrics[1]);
+            glm::vec3 shading = best->normal[0] * uvw[0] + best->normal[1] * uvw[1] + best->normal[2] * uvw[2];
+            m_hitT[i] = bestT;
+            m_hitNormal[i] = shading / glm::length(shading);
+            m_hitMaterial[i] = best->material;
+        }
+        return bestT;
+    });
+    t.resize(n);
+    normal.resize(n);
+    material.resize(n);
+    #pragma omp parallel for schedule(static)
+    for (long long i = 0; i < (long long)n; i++) {
+        t[i] = m_hitT[i];
+        normal[i] = m_hitT[i] == -1 ? glm::vec3(0.0f) : m_hitNormal[i];
+        material[i] = m_hitT[i] == -1 ? -1 : m_hitMaterial[i];
+    }
+}
+
+void OutOfCoreGeometry::occluded(const AlignedVector<glm::vec3>& origin, const AlignedVector<glm::vec3>& direction, const AlignedVector<float>& maxT, AlignedVector<unsigned char>& occluded) {
+    size_t n = origin.size();
+    // rays already occluded get a negative limit and enter no treelet
+    AlignedVector<float> limit(n);
+    for (size_t i = 0; i < n; i++) {
+        limit[i] = occluded[i] ? -1.0f : maxT[i];
+    }
+    traceBatch(origin, direction, limit, [&](unsigned int i, int treelet, float rayMaxT) {
+        if (anyInTreelet(treeletNodes(treelet), treeletTriangles(treelet), m_normalized[i], rayMaxT)) {
+            occluded[i] = 1;
+            return -1.0f;
+        }
+        return rayMaxT;
+    });
+}
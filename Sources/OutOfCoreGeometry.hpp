@@ -0,0 +1,116 @@
+#pragma once
+#include "AlignedAllocator.hpp"
+#include "BRDF.hpp"
+#include "BVH.hpp"
+#include "MappedFile.hpp"
+#include "Scene.h"
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+
+/// Triangle as stored in a treelet: everything a hit needs, so that shading never goes back to the meshes.
+struct TreeletTriangle {
+    glm::vec3 position[3];
+    glm::vec3 normal[3];
+    int material; // index in the material table of the file
+    int mesh;
+    int prim;
+};
+
+/// Node of the resident top-level tree, over the bounds of the treelets.
+struct TreeletTopNode {
+    BoundingBox3d box;
+    int left = -1;
+    int right = -1;
+    int treelet = -1; // leaves only
+};
+
+/// Location of a treelet in the file: its BVH nodes then its triangles, starting on a page boundary.
+struct TreeletEntry {
+    std::uint64_t offset;
+    std::uint64_t bytes;
+    std::uint32_t nodeCount;
+    std::uint32_t triangleCount;
+    BoundingBox3d box;
+};
+
+/// Scene geometry paged from a file instead of held in memory. The triangles are cut into spatially coherent
+/// treelets with a BVH each; only the small tree over the treelets stays resident. Treelets are used in place from
+/// the mapping and kept resident within a byte budget, least recently used first out.
+/// Queries are batched: each ray is queued on the treelets it enters, nearest first, and a treelet is paged in once
+/// for all the rays waiting on it. Resident treelets are drained before anything is read.
+/// Not thread safe: one batch at a time, each batch is traced by OpenMP threads.
+class OutOfCoreGeometry {
+public:
+    /// Cuts the triangles of the scene into treelets of at most treeletTriangles and writes them to filename, with
+    /// the materials and the sceneHash of the scene. Only the treelet being written is held in memory besides a
+    /// reference per triangle. Throws std::ios_base::failure if the file cannot be written.
+    static void write(const std::string& filename, const std::shared_ptr<Scene> scenePtr, size_t treeletTriangles = 1 << 15);
+    /// Hash of the meshes, material ranges and material parameters of the scene: a file written from a scene with
+    /// another hash is out of date.
+    static std::uint64_t sceneHash(const std::shared_ptr<Scene> scenePtr);
+
+    /// The file is self-contained, the scene it was written from is not needed to trace it. Throws
+    /// std::ios_base::failure if the file cannot be mapped, std::runtime_error if it is not a treelet file.
+    OutOfCoreGeometry(const std::string& filename, size_t residentBytes = size_t(256) << 20);
+
+    /// Closest hits of a batch of rays, with their shading data: t along the normalized direction (-1 for a miss),
+    /// interpolated normal and index in materials() (-1 for a miss).
+    void closestHits(const AlignedVector<glm::vec3>& origin, const AlignedVector<glm::vec3>& direction, AlignedVector<float>& t, AlignedVector<glm::vec3>& normal, AlignedVector<int>& material);
+    /// Sets occluded[i] to 1 if something lies on ray i before maxT[i] (distance along the normalized direction).
+    /// Rays already marked occluded are not traced.
+    void occluded(const AlignedVector<glm::vec3>& origin, const AlignedVector<glm::vec3>& direction, const AlignedVector<float>& maxT, AlignedVector<unsigned char>& occluded);
+
+    inline size_t triangleCount() const { return m_triangleCount; }
+    inline std::uint64_t contentHash() const { return m_contentHash; }
+    /// Bounds of all the triangles, empty if there are none.
+    inline BoundingBox3d bounds() const { return m_top.empty() ? BoundingBox3d{0, 0, 0, 0, 0, 0} : m_top[0].box; }
+    inline size_t treeletCount() const { return m_treelets.size(); }
+    inline const std::vector<std::shared_ptr<Material>>& materials() const { return m_materials; }
+    inline size_t residentBytes() const { return m_residentBytes; }
+
+    size_t residentBudget;
+    // since construction
+    long long treeletLoads = 0;
+    long long treeletEvictions = 0;
+    size_t peakResidentBytes = 0;
+
+private:
+    /// Queues the rays on the first treelet they enter and moves them from treelet to treelet until trace
+    /// (ray, treelet) returns the distance beyond which the ray no longer looks, or -1 once it is done.
+    template<typename Trace>
+    void traceBatch(const AlignedVector<glm::vec3>& origin, const AlignedVector<glm::vec3>& direction, const AlignedVector<float>& maxT, const Trace& trace);
+    void makeResident(int treelet);
+    void evict(int treelet);
+    inline const Node* treeletNodes(int treelet) const { return reinterpret_cast<const Node*>(m_file.data() + m_treelets[treelet].offset); }
+    inline const TreeletTriangle* treeletTriangles(int treelet) const {
+        return reinterpret_cast<const TreeletTriangle*>(treeletNodes(treelet) + m_treelets[treelet].nodeCount);
+    }
+
+    MappedFile m_file;
+    std::vector<std::shared_ptr<Material>> m_materials;
+    std::vector<TreeletTopNode> m_top;
+    std::vector<TreeletEntry> m_treelets;
+    size_t m_triangleCount = 0;
+    std::uint64_t m_contentHash = 0;
+    // residency, most recently used first
+    std::list<int> m_lru;
+    std::vector<std::list<int>::iterator> m_lruPosition;
+    std::vector<unsigned char> m_resident;
+    size_t m_residentBytes = 0;
+    // per batch: treelets entered by ray i, nearest first, in [m_firstEntry[i], m_firstEntry[i + 1])
+    std::vector<size_t> m_firstEntry;
+    std::vector<float> m_entryT;
+    std::vector<int> m_entryTreelet;
+    std::vector<size_t> m_cursor;
+    std::vector<std::vector<unsigned int>> m_queues;
+    std::vector<unsigned int> m_rays;
+    std::vector<int> m_next;
+    std::vector<Ray> m_normalized;
+    // closest hit state
+    std::vector<float> m_hitT;
+    std::vector<glm::vec3> m_hitNormal;
+    std::vector<int> m_hitMaterial;
+};
@@ -1,11 +1,27 @@
 
-#include <random>
+#include "Random.hpp"
 
-std::random_device rd;
-std::mt19937 gen(rd());
+// one generator per thread, so that the parallel render stages do not share its state
+thread_local std::mt19937 gen(std::random_device{}());
     
 
 float rand_between(float l, float r) {
     std::uniform_real_distribution<float> dist(l, r);
     return dist(gen);
+}
+
+float rand_between(std::mt19937& generator, float l, float r) {
+    std::uniform_real_distribution<float> dist(l, r);
+    return dist(generator);
+}
+
+unsigned int pixel_seed(unsigned int x, unsigned int y, unsigned int frame) {
+    // lowbias32 integer hash of the pixel coordinates and the frame number
+    unsigned int h = x * 0x8da6b343u ^ y * 0xd8163841u ^ frame * 0xcb1ab31fu;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h;
 }
\ No newline at end of file
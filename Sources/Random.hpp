@@ -1,4 +1,8 @@
+#pragma once
+#include <random>
 
+float rand_between(float l, float r);
+float rand_between(std::mt19937& generator, float l, float r);
 
-
-float rand_between(float l, float r);
\ No newline at end of file
+/// Deterministic seed for a per-pixel generator, so that pixels can be rendered in any order or in parallel.
+unsigned int pixel_seed(unsigned int x, unsigned int y, unsigned int frame);
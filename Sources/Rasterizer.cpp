@@ -67,6 +67,38 @@ void Rasterizer::updateDisplayedImageTexture (std::shared_ptr<Image> imagePtr) {
    	// Generating mipmaps for filtered texture fetch
 	glGenerateMipmap(GL_TEXTURE_2D);
 	glBindTexture (GL_TEXTURE_2D, 0);
+	m_displayImageWidth = imagePtr->width ();
+	m_displayImageHeight = imagePtr->height ();
+}
+
+void Rasterizer::updateDisplayedImageRegion (const Image & image, size_t x0, size_t y0, size_t x1, size_t y1) {
+	if (image.width () != m_displayImageWidth || image.height () != m_displayImageHeight) {
+		glBindTexture (GL_TEXTURE_2D, m_displayImageTex);
+		glTexImage2D (GL_TEXTURE_2D, 0, GL_RGB, static_cast<GLsizei> (image.width ()), static_cast<GLsizei> (image.height ()), 0, GL_RGB, GL_FLOAT, image.pixels ().data ());
+		glGenerateMipmap (GL_TEXTURE_2D);
+		glBindTexture (GL_TEXTURE_2D, 0);
+		m_displayImageWidth = image.width ();
+		m_displayImageHeight = image.height ();
+		return;
+	}
+	if (x1 <= x0 || y1 <= y0)
+		return;
+	glBindTexture (GL_TEXTURE_2D, m_displayImageTex);
+	// rows of the region are strided by the full image width
+	glPixelStorei (GL_UNPACK_ROW_LENGTH, static_cast<GLint> (image.width ()));
+	glTexSubImage2D (
+		GL_TEXTURE_2D,
+		0,
+		static_cast<GLint> (x0),
+		static_cast<GLint> (y0),
+		static_cast<GLsizei> (x1 - x0),
+		static_cast<GLsizei> (y1 - y0),
+		GL_RGB,
+		GL_FLOAT,
+		&image (x0, y0));
+	glPixelStorei (GL_UNPACK_ROW_LENGTH, 0);
+	glGenerateMipmap (GL_TEXTURE_2D);
+	glBindTexture (GL_TEXTURE_2D, 0);
 }
 
 void Rasterizer::initDisplayedImage () {
@@ -123,7 +155,16 @@ void Rasterizer::render (std::shared_ptr<Scene> scenePtr) {
 		glm::mat4 normalMatrix = glm::transpose (glm::inverse (modelViewMatrix));
 		m_pbrShaderProgramPtr->set ("modelViewMat", modelViewMatrix);
 		m_pbrShaderProgramPtr->set ("normalMat", normalMatrix);
-		draw (i, scenePtr->mesh (i)->mesh->triangleIndices().size ());
+		auto modelPtr = scenePtr->mesh (i);
+		if (modelPtr->ranges.empty ()) {
+			setMaterial (*modelPtr->material);
+			draw (i, 0, modelPtr->mesh->triangleIndices().size ());
+		}
+		// one draw per material, the ranges share the buffers of the mesh
+		for (const auto & range : modelPtr->ranges) {
+			setMaterial (*range.material);
+			draw (i, range.first, range.count);
+		}
 	}
 	m_pbrShaderProgramPtr->stop ();
 	
@@ -131,6 +172,10 @@ void Rasterizer::render (std::shared_ptr<Scene> scenePtr) {
 
 void Rasterizer::display (std::shared_ptr<Image> imagePtr) {
 	updateDisplayedImageTexture (imagePtr);
+	displayTexture ();
+}
+
+void Rasterizer::displayTexture () {
 	glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // Erase the color and z buffers.
 	m_displayShaderProgramPtr->use (); // Activate the program to be used for upcoming primitive
 	glActiveTexture (GL_TEXTURE0);
@@ -209,7 +254,13 @@ void Rasterizer::initScreeQuad () {
 	);
 }
 
-void Rasterizer::draw (size_t meshId, size_t triangleCount) {
+void Rasterizer::setMaterial (const Material & material) {
+	m_pbrShaderProgramPtr->set ("material.albedo", glm::vec3 (material.albedo));
+	m_pbrShaderProgramPtr->set ("material.roughness", material.roughness);
+	m_pbrShaderProgramPtr->set ("material.emission", material.emission);
+}
+
+void Rasterizer::draw (size_t meshId, size_t firstTriangle, size_t triangleCount) {
 	glBindVertexArray (m_vaos[meshId]); // Activate the VAO storing geometry data
-	glDrawElements (GL_TRIANGLES, static_cast<GLsizei> (triangleCount * 3), GL_UNSIGNED_INT, 0); // Call for rendering: stream the current GPU geometry through the current GPU program
+	glDrawElements (GL_TRIANGLES, static_cast<GLsizei> (triangleCount * 3), GL_UNSIGNED_INT, reinterpret_cast<const void *> (firstTriangle * sizeof (glm::uvec3))); // Call for rendering: stream the current GPU geometry through the current GPU program
 }
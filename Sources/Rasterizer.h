@@ -27,11 +27,15 @@ public:
 	void init (const std::string & basepath, const std::shared_ptr<Scene> scenePtr);
 	void setResolution (int width, int height);
 	void updateDisplayedImageTexture (std::shared_ptr<Image> imagePtr);
+	/// Uploads the [x0, x1) x [y0, y1) region of the image only, the whole image if the texture has another size.
+	void updateDisplayedImageRegion (const Image & image, size_t x0, size_t y0, size_t x1, size_t y1);
 	void initDisplayedImage ();
 	/// Loads and compile the programmable shader pipeline
 	void loadShaderProgram (const std::string & basePath);
 	void render (std::shared_ptr<Scene> scenePtr);
 	void display (std::shared_ptr<Image> imagePtr);
+	/// Draws the display texture as last uploaded.
+	void displayTexture ();
 	void clear ();
 
 private:
@@ -39,12 +43,17 @@ private:
 	GLuint genGPUVertexArray (GLuint posVbo, GLuint ibo, bool hasNormals, GLuint normalVbo);
 	GLuint toGPU (std::shared_ptr<Model> meshPtr);
 	void initScreeQuad ();
-	void draw (size_t meshId, size_t triangleCount);
+	/// Material uniforms of the following draws.
+	void setMaterial (const Material & material);
+	/// Draws triangles [firstTriangle, firstTriangle + triangleCount) of a mesh.
+	void draw (size_t meshId, size_t firstTriangle, size_t triangleCount);
 
 	/// Pointer to GPU shader pipeline i.e., set of shaders structured in a GPU program
 	std::shared_ptr<ShaderProgram> m_pbrShaderProgramPtr; // A GPU program contains at least a vertex shader and a fragment shader
 	std::shared_ptr<ShaderProgram> m_displayShaderProgramPtr; // Full screen quad shader program, for displaying 2D color images
 	GLuint m_displayImageTex; // Texture storing the image to display in non-rasterization mode
+	size_t m_displayImageWidth = 0;
+	size_t m_displayImageHeight = 0;
 	GLuint m_screenQuadVao;  // Full-screen quad drawn when displaying an image (no scene rasterization) 
 
 	std::vector<GLuint> m_vaos;
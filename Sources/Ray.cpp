@@ -1,6 +1,11 @@
 #include "Ray.hpp"
 
 bool rayTriangleIntersect(const Ray& ray, const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2, float& t) {
+    glm::vec2 barycentrics;
+    return rayTriangleIntersect(ray, p0, p1, p2, t, barycentrics);
+}
+
+bool rayTriangleIntersect(const Ray& ray, const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2, float& t, glm::vec2& barycentrics) {
     const float EPSILON = 0.000001;
     glm::vec3 edge1, edge2, h, s, q;
     float a, f, u, v;
@@ -28,6 +33,7 @@ bool rayTriangleIntersect(const Ray& ray, const glm::vec3& p0, const glm::vec3&
 
     t = f * glm::dot(edge2, q);
     if (t > EPSILON) {
+        barycentrics = glm::vec2(u, v);
 		return true;
 	}
 
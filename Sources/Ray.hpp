@@ -33,6 +33,18 @@ struct RayHit {
 };
 
 
+/// Nearest hit as found by the traversal: enough to find the surface again, shading data is computed once for the
+/// final hit (see SceneGeometry::resolveSurface).
+struct HitRecord {
+	float t = -1;
+	int prim = -1; // triangle index in its mesh
+	int mesh = -1;
+	int material = -1; // index in SceneGeometry::materials
+	glm::vec2 barycentrics = glm::vec2(0.0f); // weights of the second and third vertices
+};
+
 bool rayTriangleIntersect(const Ray& ray, const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2, float& t);
+/// Also returns the barycentric weights of p1 and p2 at the hit point.
+bool rayTriangleIntersect(const Ray& ray, const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2, float& t, glm::vec2& barycentrics);
 
 glm::vec3 computeBarycentricCoordinates(const glm::vec3& point, const glm::vec3& A, const glm::vec3& B, const glm::vec3& C);
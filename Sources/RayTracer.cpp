@@ -13,173 +13,835 @@
 #include "BRDF.hpp"
 #include "LightCut.hpp"
 #include "BVH.hpp"
+#include "Random.hpp"
 #include <random>
 #include <sstream>
+#include <omp.h>
 
-RayTracer::RayTracer(bool useLightCuts, bool renderPreview, bool lightCutsSampling, bool lightCutsOnlyDiffuse) : 
-	m_imagePtr (std::make_shared<Image>()), useLightCuts(useLightCuts), renderPreview(renderPreview), lightCutsSampling(lightCutsSampling), lightCutsOnlyDiffuse(lightCutsOnlyDiffuse) {}
+RayTracer::RayTracer(bool useLightCuts, bool renderPreview, bool lightCutsSampling, bool lightCutsOnlyDiffuse, int lightCutsStochasticSize) : 
+	useLightCuts(useLightCuts), renderPreview(renderPreview), lightCutsSampling(lightCutsSampling), lightCutsOnlyDiffuse(lightCutsOnlyDiffuse), lightCutsStochasticSize(lightCutsStochasticSize), m_imagePtr (std::make_shared<Image>()), m_budgetImagePtr (std::make_shared<Image>()), m_sampleCountImagePtr (std::make_shared<Image>()) {}
 
-RayTracer::~RayTracer() {}
+RayTracer::~RayTracer() {
+	cancel ();
+}
 
 void RayTracer::init (const std::shared_ptr<Scene> scenePtr) {
 }
 
-std::vector<BVH<std::vector<glm::vec3>>> bvh; 
-std::vector<glm::vec3> framePos;
-std::vector<glm::vec3> frameNormals;
+void PixelSamples::add (const glm::vec3 & sample) {
+	count++;
+	mean += (sample - mean) / float (count);
+	float luminance = 0.2126f * sample[0] + 0.7152f * sample[1] + 0.0722f * sample[2];
+	float delta = luminance - luminanceMean;
+	luminanceMean += delta / float (count);
+	m2 += delta * (luminance - luminanceMean);
+}
 
+float PixelSamples::relativeError (float floor) const {
+	if (count < 2)
+		return std::numeric_limits<float>::max ();
+	float variance = m2 / float (count - 1);
+	return std::sqrt (variance / float (count)) / std::max (luminanceMean, floor);
+}
 
-void initBVH(const std::shared_ptr<Scene> scenePtr) {
-	bvh.clear();
-	auto camera = scenePtr->camera();
-	for (int i = 0; i < scenePtr->numOfMeshes(); i++) {
-		auto mesh = scenePtr->mesh(i)->mesh;
-		framePos = mesh->vertexPositions();
-		frameNormals = mesh->vertexNormals();
+void RayTracer::setLightCutBudget (float errorRatio, int maxCutSize, long long frameShadowRayBudget) {
+	lightCutsErrorRatio = errorRatio;
+	lightCutsMaxCutSize = maxCutSize;
+	this->frameShadowRayBudget = frameShadowRayBudget;
+}
 
-		auto triangles = mesh->triangleIndices();
-		std::vector<std::vector<glm::vec3>> triPos;
-		for (int i = 0; i < triangles.size(); i++) {
-			triPos.push_back({framePos[triangles[i][0]], framePos[triangles[i][1]], framePos[triangles[i][2]]});
-		}
-		bvh.emplace_back(triPos);
-		bvh.back().build();
-	}
+HitRecord raySceneClosestHitBVH (Ray ray, const SceneGeometry & geometry) {
+	ray.normalize();
+	return geometry.closestHit(ray);
 }
 
-RayHit raySceneIntersectionBVH(Ray ray, const std::shared_ptr<Scene> scenePtr) {
-	RayHit hit;
+RayHit raySceneIntersectionBVH (Ray ray, const SceneGeometry & geometry) {
 	ray.normalize();
-	auto camera = scenePtr->camera();
-	for (int i = 0; i < scenePtr->numOfMeshes(); i++) {
-		auto mesh = scenePtr->mesh(i)->mesh;
-		auto triangles = mesh->triangleIndices();
-		
-		
-		bvh[i].checkHit(0, ray, [&](int idx){
-			glm::vec3 p0 = framePos[triangles[idx][0]];
-			glm::vec3 p1 = framePos[triangles[idx][1]];
-			glm::vec3 p2 = framePos[triangles[idx][2]];
-
-			glm::vec3 n0 = frameNormals[triangles[idx][0]];
-			glm::vec3 n1 = frameNormals[triangles[idx][1]];
-			glm::vec3 n2 = frameNormals[triangles[idx][2]];
-			float t;
-			if (rayTriangleIntersect(ray, p0, p1, p2, t) ) {
-				RayHit new_hit;
-				new_hit.brdf = BRDF(scenePtr->mesh(i)->material);
-				glm::vec3 pos = ray.origin + ray.direction * t;
-				glm::vec3 uvw = computeBarycentricCoordinates(pos, p0, p1, p2);
-				new_hit.normal = n0 * uvw[0] + n1 * uvw[1] + n2 * uvw[2];
-				new_hit.normal /= glm::length(new_hit.normal);
-				new_hit.ray = ray;
-				new_hit.t = t;
-				hit.update(new_hit);
-			}
-		});
+	return geometry.resolveSurface(geometry.closestHit(ray), ray);
+}
+
+bool raySceneOcclusionBVH (Ray ray, float maxT, const SceneGeometry & geometry) {
+	ray.normalize();
+	return geometry.occluded(ray, maxT);
+}
+
+/// Directional lights in world space followed by the environment samples.
+std::vector<DirectionalLight> worldDirectionalLights(const std::shared_ptr<Scene> scenePtr, const glm::mat3 & invModelViewMatrix) {
+	std::vector<DirectionalLight> dls;
+	for (int i = 0; i < scenePtr->numOfLights(); i++) {
+		auto light = scenePtr->light(i);
+		dls.emplace_back(invModelViewMatrix * light->direction, light->color, light->intensity);
 	}
-	return hit;
+	if (scenePtr->environment()) {
+		const auto & samples = scenePtr->environment()->samples();
+		dls.insert(dls.end(), samples.begin(), samples.end());
+	}
+	return dls;
 }
 
-LightTree lightCutTree;
+bool RayTracer::updateAreaLights (const std::shared_ptr<Scene> scenePtr) {
+	std::vector<float> signature{(float)areaLightSampleCount};
+	for (int i = 0; i < scenePtr->numOfMeshes(); i++) {
+		auto model = scenePtr->mesh(i);
+		size_t triangleCount = model->mesh->triangleIndices ().size ();
+		std::vector<float> emission;
+		for (const auto & range : model->ranges.empty () ? std::vector<MaterialRange> {{0, triangleCount, model->material}} : model->ranges)
+			if (range.material->emission != glm::vec3 (0.f))
+				emission.insert (emission.end (), {(float)range.first, (float)range.count, range.material->emission[0], range.material->emission[1], range.material->emission[2]});
+		if (emission.empty ())
+			continue;
+		glm::vec3 sum (0.f);
+		for (const auto & p : model->mesh->vertexPositions ())
+			sum += p;
+		signature.insert (signature.end(), {(float)i, (float)triangleCount, sum[0], sum[1], sum[2]});
+		signature.insert (signature.end(), emission.begin (), emission.end ());
+	}
+	if (signature == m_areaLightSignature)
+		return false;
+	m_areaLightSignature = signature;
+	m_areaLights = AreaLights::sample(scenePtr, areaLightSampleCount);
+	if (!m_areaLights.empty ())
+		Console::print (std::to_string (m_areaLights.size ()) + " area light samples on emissive triangles");
+	return true;
+}
 
-void RayTracer::initLightCuts(const std::shared_ptr<Scene> scenePtr) {
-	std::vector<std::shared_ptr<PointLight>> pls;
+bool RayTracer::updateVirtualLights (const std::shared_ptr<Scene> scenePtr, const glm::mat3 & invModelViewMatrix, const CancellationToken * token) {
+	if (vplSettings.count <= 0 || outOfCoreOnly (scenePtr)) {
+		// nothing to trace (light paths need the in-core BVH), directional emitters turning with the camera do not matter
+		m_vplSignature.clear ();
+		if (m_vpls.empty ())
+			return false;
+		m_vpls.clear ();
+		return true;
+	}
+	std::vector<float> signature{(float)vplSettings.count, (float)vplSettings.maxBounces, vplSettings.clamp, (float)vplSettings.seed};
 	for (int i = 0; i < scenePtr->numOfPLights(); i++) {
-		pls.push_back(scenePtr->pLight(i));
+		auto light = scenePtr->pLight(i);
+		glm::vec3 p = light->getTranslation();
+		signature.insert (signature.end(), {p[0], p[1], p[2], light->color[0], light->color[1], light->color[2], light->intensity, light->normal[0], light->normal[1], light->normal[2]});
+	}
+	for (const auto & light : worldDirectionalLights(scenePtr, invModelViewMatrix))
+		signature.insert (signature.end(), {light.direction[0], light.direction[1], light.direction[2], light.color[0], light.color[1], light.color[2], light.intensity});
+	if (signature == m_vplSignature)
+		return false;
+	m_vplSignature = signature;
+	m_vpls = VirtualLights::generate(scenePtr, m_geometry, invModelViewMatrix, vplSettings, m_areaLights, token ? &token->cancelled : nullptr);
+	if (token && token->cancelled) {
+		m_vplSignature.clear (); // interrupted, generated again by the next frame
+		return true;
 	}
-	lightCutTree.build(pls);
-	lightCutTree.enable_sampling = lightCutsSampling;
-	lightCutTree.only_diffuse = lightCutsOnlyDiffuse;
+	if (vplSettings.count > 0)
+		Console::print (std::to_string (m_vpls.size ()) + " virtual point lights generated");
+	return true;
 }
 
+bool RayTracer::initLightCuts(const std::shared_ptr<Scene> scenePtr, const glm::mat3 & invModelViewMatrix, const CancellationToken * token) {
+	const auto & pls = m_pointLights;
+	const std::atomic<bool> * cancelled = token ? &token->cancelled : nullptr;
+	bool rebuilt = true;
+	if (m_generatedLightsChanged) {
+		// every generated light is new, refitting them one by one would only end in a rebuild
+		m_lightTree.build(pls, cancelled);
+	} else {
+		// only the lights that moved, changed or appeared since the previous frame are refitted
+		rebuilt = m_lightTree.sync(pls, cancelled);
+	}
+	// an interrupted build leaves an empty tree, rebuilt by the next frame
+	if (cancelled && *cancelled)
+		return false;
+	if (rebuilt)
+		Console::print ("Light tree rebuilt for " + std::to_string (pls.size ()) + " lights");
+	// directional lights follow the camera, their subtree is cheap enough to rebuild every frame
+	m_lightTree.buildDirectional(worldDirectionalLights(scenePtr, invModelViewMatrix));
+	m_lightTree.enable_sampling = lightCutsSampling;
+	m_lightTree.only_diffuse = lightCutsOnlyDiffuse;
+	m_lightTree.stochastic_cut_size = lightCutsStochasticSize;
+	m_lightTree.error_ratio = lightCutsErrorRatio;
+	m_lightTree.max_cut_size = lightCutsMaxCutSize;
+	return true;
+}
 
-glm::vec3 GetPointLightNative(const std::shared_ptr<Scene> scenePtr, Ray ray, RayHit hit) {
+
+glm::vec3 GetDirectionalLightNative(const SceneGeometry & geometry, Ray ray, RayHit hit, const std::vector<DirectionalLight> & lights) {
 	glm::vec3 res{0};
-	for (int i = 0; i < scenePtr->numOfPLights(); i++) {
-		auto light = scenePtr->pLight(i);
+	glm::vec3 pos = ray.origin + ray.direction * hit.t;
+	for (const auto & light : lights) {
+		auto dir = glm::normalize(light.direction);
+		HitRecord light_hit = raySceneClosestHitBVH(Ray{pos - dir * 0.01f, -dir}, geometry);
+		if (light_hit.t == -1) {
+			res += hit.brdf(BRDFArgs{hit.normal, glm::normalize(-ray.direction), -dir}) * light.color * light.intensity;
+		}
+	}
+	return res;
+}
+
+glm::vec3 GetPointLightNative(const SceneGeometry & geometry, Ray ray, RayHit hit, const std::vector<std::shared_ptr<PointLight>> & lights) {
+	glm::vec3 res{0};
+	for (const auto & light : lights) {
 		glm::vec3 pos = ray.origin + ray.direction * hit.t;
 		auto dir = light->getTranslation() - pos;
 		auto dirNorm = glm::length(dir);
-		RayHit light_hit = raySceneIntersectionBVH(Ray{pos + dir * 0.001f, +dir}, scenePtr);
+		float emission = emitterCosine(light->normal, -dir / dirNorm);
+		if (emission <= 0.f)
+			continue;
+		HitRecord light_hit = raySceneClosestHitBVH(Ray{pos + dir * 0.001f, +dir}, geometry);
 		if (light_hit.t == -1 || light_hit.t >= dirNorm - 0.001f) {
-			res += hit.brdf(BRDFArgs{hit.normal, glm::normalize(-ray.direction), dir / dirNorm}) * light->color * light->intensity / dirNorm / dirNorm;
+			res += hit.brdf(BRDFArgs{hit.normal, glm::normalize(-ray.direction), dir / dirNorm}) * light->color * light->intensity * emission / dirNorm / dirNorm;
 		}
 	}
 	return res;
 }
 
-glm::vec3 RayTracer::GetPointLightCuts(const std::shared_ptr<Scene> scenePtr, Ray ray, RayHit hit, bool print) {
+/// Surface patch of a shading point inside a tile: the octant of its normal, so that facing surfaces do not share.
+static long long visibilityKey (int node, const glm::vec3 & normal) {
+	int octant = (normal[0] > 0.f ? 1 : 0) | (normal[1] > 0.f ? 2 : 0) | (normal[2] > 0.f ? 4 : 0);
+	return (long long)node * 8 + octant;
+}
+
+int VisibilityCache::lookup (int node, const glm::vec3 & normal) {
+	auto it = entries.find (visibilityKey (node, normal));
+	if (it == entries.end ())
+		return -1;
+	Entry & entry = it->second;
+	if (entry.lit + entry.occluded < minSamples || (entry.lit > 0 && entry.occluded > 0))
+		return -1;
+	// validate now and then, a boundary missed by the first samples turns the entry mixed
+	if (++entry.uses % validationPeriod == 0)
+		return -1;
+	return entry.lit > 0 ? 1 : 0;
+}
+
+void VisibilityCache::record (int node, const glm::vec3 & normal, bool lit) {
+	Entry & entry = entries[visibilityKey (node, normal)];
+	if (lit)
+		entry.lit++;
+	else
+		entry.occluded++;
+}
+
+glm::vec3 RayTracer::GetPointLightCuts(Ray ray, RayHit hit, std::mt19937& rng, int budget, bool* budgetHit, std::vector<int>* coherentCut, VisibilityCache* visibility, std::vector<ShadowRayRequest>* shadowQueue, size_t pixel, bool print) {
 	glm::vec3 pos = ray.origin + ray.direction * hit.t;
 	glm::vec3 res{0};
 	auto brdfArgs = BRDFArgs{hit.normal, glm::normalize(-ray.direction), glm::vec3{0.0f}};
-	auto lights = lightCutTree.getLights(pos, hit.brdf, brdfArgs, print);
+	// one cut refinement state per rendering thread
+	static thread_local LightCutScratch scratch;
+	auto lights = lightCutsStochasticSize > 0
+		? m_lightTree.getStochasticLights(pos, hit.brdf, brdfArgs, rng, budget, budgetHit)
+		: m_lightTree.getLights(pos, hit.brdf, brdfArgs, scratch, budget, budgetHit, coherentCut, print);
 	sumLightsPerRay += lights.size();
 	cntLightsPerRay += 1;
-	for (auto light : lights) {
-		auto dir = light->getTranslation() - pos;
-		auto dirNorm = glm::length(dir);
-		RayHit light_hit = raySceneIntersectionBVH(Ray{pos + dir * 0.001f, +dir}, scenePtr);
-		if (light_hit.t == -1 || light_hit.t >= dirNorm - 0.001f) {
-			res += hit.brdf(BRDFArgs{hit.normal, glm::normalize(-ray.direction), dir / dirNorm}) * light->color * light->intensity / dirNorm / dirNorm;
+	m_remainingShadowRays -= lights.size();
+	// cached outcome of the shadow ray towards the light, traced when unknown or queued for the batch
+	auto visible = [&] (const LightSample & light, const Ray & shadowRay, float maxT, const glm::vec3 & contribution) {
+		int cached = visibility ? visibility->lookup (light.node, hit.normal) : -1;
+		if (cached != -1) {
+			shadowRaysCached++;
+			return cached == 1;
 		}
+		if (shadowQueue) {
+			const glm::vec3 & d = shadowRay.direction;
+			int octant = (d[0] > 0.f ? 1 : 0) | (d[1] > 0.f ? 2 : 0) | (d[2] > 0.f ? 4 : 0);
+			shadowQueue->push_back (ShadowRayRequest{shadowRay, maxT, contribution, pixel, light.node, hit.normal, octant * m_lightTree.size () + light.node});
+			return false;
+		}
+		shadowRaysTraced++;
+		bool lit = !raySceneOcclusionBVH(shadowRay, maxT, m_geometry);
+		if (visibility)
+			visibility->record (light.node, hit.normal, lit);
+		return lit;
+	};
+	for (const auto & light : lights) {
+		if (light.directional) {
+			glm::vec3 contribution = hit.brdf(BRDFArgs{hit.normal, glm::normalize(-ray.direction), light.position}) * light.color * light.intensity;
+			if (visible (light, Ray{pos + light.position * 0.01f, light.position}, std::numeric_limits<float>::max (), contribution))
+				res += contribution;
+			continue;
+		}
+		auto dir = light.position - pos;
+		auto dirNorm = glm::length(dir);
+		float emission = emitterCosine(light.normal, -dir / dirNorm);
+		if (emission <= 0.f)
+			continue;
+		glm::vec3 contribution = hit.brdf(BRDFArgs{hit.normal, glm::normalize(-ray.direction), dir / dirNorm}) * light.color * light.intensity * emission / dirNorm / dirNorm;
+		if (visible (light, Ray{pos + dir * 0.001f, +dir}, dirNorm - 0.001f, contribution))
+			res += contribution;
 	}
 	return res;
 }
 
-void RayTracer::render (const std::shared_ptr<Scene> scenePtr) {
-	size_t width = m_imagePtr->width();
-	size_t height = m_imagePtr->height();
-	if (renderPreview) {
-		width /= 4;
-		height /= 4;
+void RayTracer::flushShadowRays (std::vector<ShadowRayRequest> & queue, VisibilityCache * visibility, Image & image) {
+	// rays of the same octant towards the same cluster walk the same BVH nodes one after the other
+	std::sort (queue.begin (), queue.end (), [] (const ShadowRayRequest & a, const ShadowRayRequest & b) { return a.order < b.order; });
+	for (const auto & request : queue) {
+		shadowRaysTraced++;
+		bool lit = !raySceneOcclusionBVH(request.ray, request.maxT, m_geometry);
+		if (visibility)
+			visibility->record (request.node, request.normal, lit);
+		if (lit)
+			image[request.pixel] += request.contribution;
 	}
-	std::chrono::high_resolution_clock clock;
-	Console::print ("Start ray tracing at " + std::to_string (width) + "x" + std::to_string (height) + " resolution...");
-	std::chrono::time_point<std::chrono::high_resolution_clock> before = clock.now();
-	m_imagePtr->clear (scenePtr->backgroundColor ());
- 
-    std::random_device rd;  // Will be used to obtain a seed for the random number engine
-    std::mt19937 gen(rd()); // Standard mersenne_twister_engine seeded with rd()
-    std::uniform_int_distribution<int> w_dist(0, width);
-    std::uniform_int_distribution<int> h_dist(0, height);
-	std::cout << "before init" << std::endl;
-	glm::mat4 viewMatrix = scenePtr->camera()->computeViewMatrix ();
-	glm::mat3 invModelViewMatrix = glm::inverse (viewMatrix);
-	initBVH(scenePtr);
-	if (useLightCuts)
-		initLightCuts(scenePtr);
-	std::cout << "after init" << std::endl;
-	for (int w = 0; w < width - 1; w++) {
-		for (int h = 0; h < height - 1; h++) {
-			auto camera = scenePtr->camera();
-			Ray ray = camera->rayAt((w + 0.5) / width, (h + 0.5) / height);
-			RayHit hit = raySceneIntersectionBVH(ray, scenePtr);
+	queue.clear ();
+}
+
+void RayTracer::renderTile (const std::shared_ptr<Scene> scenePtr, const RenderTile & tile, const glm::mat3 & invModelViewMatrix, size_t step, size_t previousStep, unsigned int sample, const std::vector<PixelSamples> * samples) {
+	// with light cuts the directional lights are clustered in the light tree
+	std::vector<DirectionalLight> directionalLights;
+	if (!useLightCuts)
+		directionalLights = worldDirectionalLights (scenePtr, invModelViewMatrix);
+	size_t width, height;
+	renderSize (width, height);
+	Image & image = sample > 0 ? *m_sampleImagePtr : *m_renderImagePtr;
+	// cut of the previous pixel of the tile, refinement of the next one starts from it
+	std::vector<int> tileCut;
+	glm::vec3 tileCutNormal (0.f);
+	VisibilityCache tileVisibility;
+	tileVisibility.minSamples = visibilityCacheMinSamples;
+	tileVisibility.validationPeriod = std::max (1, visibilityCacheValidation);
+	std::vector<ShadowRayRequest> shadowQueue;
+	// extra samples are stratified and jittered over the pixel, which resolves edges, the first one goes through its centre
+	CameraRayBatch cameraRays;
+	if (sample > 0)
+		m_cameraRays.generateTile (tile.x0, tile.y0, tile.x1, tile.y1, sample, std::max (1, adaptiveMaxSamples), frameIndex, cameraRays);
+	else
+		m_cameraRays.generateTile (tile.x0, tile.y0, tile.x1, tile.y1, cameraRays);
+	for (size_t h = tile.y0; h < tile.y1; h += step - h % step) {
+		for (size_t w = tile.x0; w < tile.x1; w += step - w % step) {
+			// pixels of the previous, coarser pass are already done
+			if (previousStep > 0 && w % previousStep == 0 && h % previousStep == 0)
+				continue;
+			if (samples && (*samples)[h * m_imagePtr->width () + w].converged)
+				continue;
+			std::mt19937 pixelGen(pixel_seed(w, h, frameIndex + sample * 0x9e3779b9u));
+			Ray ray = cameraRays.ray ((h - tile.y0) * (tile.x1 - tile.x0) + w - tile.x0);
+			RayHit hit = raySceneIntersectionBVH(ray, m_geometry);
+			// the pixel may still hold the block colour of a coarser pass
+			image(w, h) = scenePtr->backgroundColor ();
 			if (hit.t != -1) {
-				(*m_imagePtr)(w, h) = glm::vec3(0.0, 0.0, 0.0);//hit.material->albedo * hit.material->ka;
-				for (int i = 0; i < scenePtr->numOfLights(); i++) {
-					auto light = scenePtr->light(i);
-					glm::vec3 pos = ray.origin + ray.direction * hit.t;
-					auto dir = invModelViewMatrix * light->direction;
-					RayHit light_hit = raySceneIntersectionBVH(Ray{pos - dir * 0.01f, -dir}, scenePtr);
-					if (light_hit.t == -1) {
-						(*m_imagePtr)(w, h) += hit.brdf(BRDFArgs{hit.normal, glm::normalize(-ray.direction), -glm::normalize(dir)}) * light->color * light->intensity;
+				// emissive surfaces are seen directly, their lighting of the others comes from the area light samples
+				image(w, h) = hit.brdf.material->emission;//hit.material->albedo * hit.material->ka;
+				if (useLightCuts) {
+					// share what is left of the frame budget evenly between the remaining pixels
+					int budget = -1;
+					if (frameShadowRayBudget > 0)
+						budget = (int)std::max (1ll, std::min ((long long)lightCutsMaxCutSize, m_remainingShadowRays / std::max (1ll, m_remainingPixels.load ())));
+					bool budgetHit = false;
+					// only reuse the previous cut when the surface orientation is similar
+					if (glm::dot (hit.normal, tileCutNormal) < 0.8f)
+						tileCut.clear ();
+					tileCutNormal = hit.normal;
+					image(w, h) += GetPointLightCuts(ray, hit, pixelGen, budget, &budgetHit, lightCutsCoherentReuse ? &tileCut : nullptr, visibilityCaching ? &tileVisibility : nullptr, batchShadowRays ? &shadowQueue : nullptr, h * m_imagePtr->width () + w);
+					if (shadowQueue.size () >= shadowQueueCapacity)
+						flushShadowRays (shadowQueue, visibilityCaching ? &tileVisibility : nullptr, image);
+					if (budgetHit) {
+						(*m_budgetImagePtr)(w, h) = glm::vec3 (1.f);
+						budgetHitsPerFrame++;
 					}
+				} else {
+					image(w, h) += GetDirectionalLightNative(m_geometry, ray, hit, directionalLights);
+					image(w, h) += GetPointLightNative(m_geometry, ray, hit, m_pointLights);
 				}
-				if (useLightCuts) {
-					(*m_imagePtr)(w, h) += GetPointLightCuts(scenePtr, ray, hit);
+			}
+			m_remainingPixels--;
+			samplesPerFrame++;
+		}
+	}
+	flushShadowRays (shadowQueue, visibilityCaching ? &tileVisibility : nullptr, image);
+	if (step == 1)
+		return;
+	// coarse pass: every computed pixel stands for the step x step block it starts
+	for (size_t h = tile.y0; h < tile.y1; h++)
+		for (size_t w = tile.x0; w < tile.x1; w++)
+			image(w, h) = image(w - w % step, h - h % step);
+}
+
+bool RayTracer::refineTile (const std::shared_ptr<Scene> scenePtr, RenderJob & job, size_t tileIndex) {
+	const RenderTile & tile = job.tiles[tileIndex];
+	size_t imageWidth = m_imagePtr->width ();
+	int minSamples = std::max (2, adaptiveMinSamples);
+	auto heat = [&] (int count) {
+		float t = std::min (1.f, float (count - 1) / float (std::max (1, adaptiveMaxSamples - 1)));
+		return glm::mix (glm::vec3 (0.f, 0.f, 1.f), glm::vec3 (1.f, 0.f, 0.f), t);
+	};
+	// the full resolution pass is the first sample of every pixel
+	if (job.tileSamples[tileIndex] == 1)
+		for (size_t h = tile.y0; h < tile.y1; h++)
+			for (size_t w = tile.x0; w < tile.x1; w++) {
+				job.samples[h * imageWidth + w].add ((*m_renderImagePtr)(w, h));
+				(*m_sampleCountImagePtr)(w, h) = heat (1);
+			}
+	unsigned int sample = (unsigned int)job.tileSamples[tileIndex];
+	renderTile (scenePtr, tile, job.invModelViewMatrix, 1, 0, sample, &job.samples);
+	bool converged = true;
+	for (size_t h = tile.y0; h < tile.y1; h++)
+		for (size_t w = tile.x0; w < tile.x1; w++) {
+			PixelSamples & pixel = job.samples[h * imageWidth + w];
+			if (pixel.converged)
+				continue;
+			pixel.add ((*m_sampleImagePtr)(w, h));
+			pixel.converged = pixel.count >= adaptiveMaxSamples || (pixel.count >= minSamples && pixel.relativeError (adaptiveLuminanceFloor) < adaptiveThreshold);
+			converged = converged && pixel.converged;
+			(*m_renderImagePtr)(w, h) = pixel.mean;
+			(*m_sampleCountImagePtr)(w, h) = heat (pixel.count);
+		}
+	job.tileSamples[tileIndex]++;
+	return converged;
+}
+
+void RayTracer::renderWavefront (size_t width, size_t height, const CancellationToken * token) {
+	size_t imageWidth = m_imagePtr->width ();
+	long long rowLength = (long long)width - 1;
+	long long pixelCount = rowLength * ((long long)height - 1);
+	m_threadScratch.resize (omp_get_max_threads ());
+	m_threadCuts.resize (omp_get_max_threads ());
+	WavefrontBuffers & b = m_wavefront;
+	// rays only carry a material index, resolved to one of these by the shading stages
+	const auto & materials = outOfCoreGeometry ? outOfCoreGeometry->materials () : m_geometry.materials;
+	m_materialBrdfs.assign (materials.begin (), materials.end ());
+	// the pass always starts over, a resumed job included, and so does its share of the frame budget
+	m_remainingShadowRays = frameShadowRayBudget;
+	m_remainingPixels = pixelCount;
+	m_budgetImagePtr->clear ();
+	budgetHitsPerFrame = 0;
+	for (long long start = 0; start < pixelCount; start += wavefrontBatchSize) {
+		if (token && token->cancelled)
+			return;
+		long long n = std::min ((long long)wavefrontBatchSize, pixelCount - start);
+		b.pixel.resize (n);
+		b.origin.resize (n);
+		b.direction.resize (n);
+		b.t.resize (n);
+		b.normal.resize (n);
+		b.material.resize (n);
+		b.cutThread.resize (n);
+		b.cutOffset.resize (n);
+		b.firstShadowRay.resize (n + 1);
+
+		// camera rays
+		#pragma omp parallel for schedule(static)
+		for (long long i = 0; i < n; i++) {
+			long long x = (start + i) % rowLength;
+			long long y = (start + i) / rowLength;
+			b.pixel[i] = y * imageWidth + x;
+			Ray ray = m_cameraRays.rayAt (x + 0.5f, y + 0.5f);
+			b.origin[i] = ray.origin;
+			b.direction[i] = ray.direction;
+		}
+
+		// closest hits
+		if (outOfCoreGeometry) {
+			outOfCoreGeometry->closestHits (b.origin, b.direction, b.t, b.normal, b.material);
+		} else {
+			#pragma omp parallel for schedule(dynamic, 64)
+			for (long long i = 0; i < n; i++) {
+				HitRecord hit = raySceneClosestHitBVH (Ray{b.origin[i], b.direction[i]}, m_geometry);
+				b.t[i] = hit.t;
+				b.normal[i] = hit.t == -1 ? glm::vec3 (0.f) : m_geometry.shadingNormal (hit);
+				b.material[i] = hit.material;
+			}
+		}
+
+		// light cuts, appended to the output of the thread and gathered below by ray
+		for (auto & threadCut : m_threadCuts)
+			threadCut.clear ();
+		#pragma omp parallel for schedule(dynamic, 64)
+		for (long long i = 0; i < n; i++) {
+			int thread = omp_get_thread_num ();
+			std::vector<LightSample> & threadCut = m_threadCuts[thread];
+			b.cutThread[i] = thread;
+			b.cutOffset[i] = threadCut.size ();
+			if (b.t[i] == -1) {
+				b.firstShadowRay[i + 1] = 0;
+				m_remainingPixels--;
+				continue;
+			}
+			glm::vec3 pos = b.origin[i] + b.direction[i] * b.t[i];
+			auto brdfArgs = BRDFArgs{b.normal[i], glm::normalize (-b.direction[i]), glm::vec3{0.0f}};
+			const BRDF & brdf = m_materialBrdfs[b.material[i]];
+			// share what is left of the frame budget evenly between the remaining pixels
+			int budget = -1;
+			if (frameShadowRayBudget > 0)
+				budget = (int)std::max (1ll, std::min ((long long)lightCutsMaxCutSize, m_remainingShadowRays / std::max (1ll, m_remainingPixels.load ())));
+			bool budgetHit = false;
+			if (lightCutsStochasticSize > 0) {
+				std::mt19937 pixelGen (pixel_seed ((start + i) % rowLength, (start + i) / rowLength, frameIndex));
+				m_lightTree.getStochasticLights (pos, brdf, brdfArgs, pixelGen, m_threadScratch[thread], threadCut, budget, &budgetHit);
+			} else {
+				m_lightTree.getLights (pos, brdf, brdfArgs, m_threadScratch[thread], threadCut, budget, &budgetHit);
+			}
+			// cut size of the ray until the prefix sum
+			b.firstShadowRay[i + 1] = threadCut.size () - b.cutOffset[i];
+			m_remainingShadowRays -= b.firstShadowRay[i + 1];
+			m_remainingPixels--;
+			if (budgetHit) {
+				(*m_budgetImagePtr)[b.pixel[i]] = glm::vec3 (1.f);
+				budgetHitsPerFrame++;
+			}
+		}
+		b.firstShadowRay[0] = 0;
+		for (long long i = 0; i < n; i++)
+			b.firstShadowRay[i + 1] += b.firstShadowRay[i];
+		size_t shadowCount = b.firstShadowRay[n];
+		b.cut.resize (shadowCount);
+		#pragma omp parallel for schedule(static)
+		for (long long i = 0; i < n; i++) {
+			auto first = m_threadCuts[b.cutThread[i]].begin () + b.cutOffset[i];
+			std::copy (first, first + (b.firstShadowRay[i + 1] - b.firstShadowRay[i]), b.cut.begin () + b.firstShadowRay[i]);
+		}
+		b.shadowOrigin.resize (shadowCount);
+		b.shadowDirection.resize (shadowCount);
+		b.shadowMaxT.resize (shadowCount);
+		b.shadowContribution.resize (shadowCount);
+		b.occluded.resize (shadowCount);
+
+		// shadow rays and the contribution they carry
+		#pragma omp parallel for schedule(static)
+		for (long long i = 0; i < n; i++) {
+			if (b.t[i] == -1)
+				continue;
+			glm::vec3 pos = b.origin[i] + b.direction[i] * b.t[i];
+			glm::vec3 cameraDir = glm::normalize (-b.direction[i]);
+			const BRDF & brdf = m_materialBrdfs[b.material[i]];
+			for (size_t j = b.firstShadowRay[i]; j < b.firstShadowRay[i + 1]; j++) {
+				const LightSample & light = b.cut[j];
+				if (light.directional) {
+					b.shadowOrigin[j] = pos + light.position * 0.01f;
+					b.shadowDirection[j] = light.position;
+					b.shadowMaxT[j] = std::numeric_limits<float>::max ();
+					b.shadowContribution[j] = brdf (BRDFArgs{b.normal[i], cameraDir, light.position}) * light.color * light.intensity;
 				} else {
-					(*m_imagePtr)(w, h) += GetPointLightNative(scenePtr, ray, hit);
+					auto dir = light.position - pos;
+					auto dirNorm = glm::length (dir);
+					float emission = emitterCosine (light.normal, -dir / dirNorm);
+					b.shadowOrigin[j] = pos + dir * 0.001f;
+					b.shadowDirection[j] = dir;
+					b.shadowMaxT[j] = dirNorm - 0.001f;
+					b.shadowContribution[j] = emission > 0.f ? brdf (BRDFArgs{b.normal[i], cameraDir, dir / dirNorm}) * light.color * light.intensity * emission / dirNorm / dirNorm : glm::vec3 (0.f);
 				}
 			}
 		}
+
+		// shadow rays any-hit
+		if (outOfCoreGeometry) {
+			#pragma omp parallel for schedule(static)
+			for (long long j = 0; j < (long long)shadowCount; j++)
+				b.occluded[j] = b.shadowContribution[j] == glm::vec3 (0.f) ? 1 : 0;
+			outOfCoreGeometry->occluded (b.shadowOrigin, b.shadowDirection, b.shadowMaxT, b.occluded);
+		} else {
+			#pragma omp parallel for schedule(dynamic, 256)
+			for (long long j = 0; j < (long long)shadowCount; j++) {
+				if (b.shadowContribution[j] == glm::vec3 (0.f))
+					b.occluded[j] = 1;
+				else
+					b.occluded[j] = raySceneOcclusionBVH (Ray{b.shadowOrigin[j], b.shadowDirection[j]}, b.shadowMaxT[j], m_geometry) ? 1 : 0;
+			}
+		}
+
+		// accumulation
+		#pragma omp parallel for schedule(static)
+		for (long long i = 0; i < n; i++) {
+			if (b.t[i] == -1)
+				continue;
+			glm::vec3 color = m_materialBrdfs[b.material[i]].material->emission;
+			for (size_t j = b.firstShadowRay[i]; j < b.firstShadowRay[i + 1]; j++)
+				if (!b.occluded[j])
+					color += b.shadowContribution[j];
+			(*m_renderImagePtr)[b.pixel[i]] = color;
+		}
+
+		for (long long i = 0; i < n; i++)
+			cntLightsPerRay += b.t[i] != -1 ? 1 : 0;
+		sumLightsPerRay += shadowCount;
+		shadowRaysTraced += shadowCount;
+		// rows touched by the batch
+		publishTile (RenderTile{0, size_t (start / rowLength), size_t (rowLength), size_t ((start + n - 1) / rowLength + 1)});
+	}
+}
+
+void RayTracer::renderSize (size_t & width, size_t & height) const {
+	width = m_imagePtr->width();
+	height = m_imagePtr->height();
+	if (renderPreview) {
+		width /= 4;
+		height /= 4;
+	}
+}
+
+glm::mat3 RayTracer::beginFrame (const std::shared_ptr<Scene> scenePtr) {
+	size_t width, height;
+	renderSize (width, height);
+	Console::print ("Start ray tracing at " + std::to_string (width) + "x" + std::to_string (height) + " resolution...");
+	if (m_budgetImagePtr->width () != m_imagePtr->width () || m_budgetImagePtr->height () != m_imagePtr->height ())
+		m_budgetImagePtr = std::make_shared<Image> (m_imagePtr->width (), m_imagePtr->height ());
+	m_budgetImagePtr->clear ();
+	budgetHitsPerFrame = 0;
+	shadowRaysTraced = 0;
+	shadowRaysCached = 0;
+	sumLightsPerRay = 0;
+	cntLightsPerRay = 0;
+	samplesPerFrame = 0;
+	m_remainingShadowRays = frameShadowRayBudget;
+	m_remainingPixels = (long long)(width - 1) * (long long)(height - 1);
+	// built once per frame, the workers keep using it while the camera moves
+	m_cameraRays = CameraRayGenerator (*scenePtr->camera(), width, height);
+	glm::mat4 viewMatrix = scenePtr->camera()->computeViewMatrix ();
+	glm::mat3 invModelViewMatrix = glm::inverse (viewMatrix);
+	frameIndex++;
+	return invModelViewMatrix;
+}
+
+bool RayTracer::prepareFrame (const std::shared_ptr<Scene> scenePtr, const glm::mat3 & invModelViewMatrix, const CancellationToken * token) {
+	auto cancelled = [token] () { return token && token->cancelled; };
+	if (outOfCoreOnly (scenePtr)) {
+		if (!useLightCuts) {
+			Console::print ("Nothing to ray trace: the out-of-core geometry is only traced by light cuts");
+			return false;
+		}
+		if (!wavefront || adaptiveSampling || vplSettings.count > 0)
+			Console::print ("Out-of-core geometry only: wavefront pipeline used, adaptive sampling and VPLs skipped");
+	}
+	// a wavefront frame traces the paged geometry only, unless VPLs or adaptive samples go through the BVH
+	if (outOfCoreGeometry && useLightCuts && (outOfCoreOnly (scenePtr) || (wavefront && !adaptiveSampling && vplSettings.count == 0)))
+		m_geometry = SceneGeometry ();
+	else if (!m_geometry.isUpToDate (scenePtr))
+		m_geometry.build(scenePtr);
+	if (cancelled ())
+		return false;
+	if (updateAreaLights(scenePtr)) {
+		m_generatedLightsChanged = true;
+		m_vplSignature.clear (); // area lights are emitters of the VPLs
+	}
+	if (cancelled ())
+		return false;
+	m_generatedLightsChanged = updateVirtualLights(scenePtr, invModelViewMatrix, token) || m_generatedLightsChanged;
+	if (cancelled ())
+		return false;
+	m_pointLights.clear ();
+	for (int i = 0; i < scenePtr->numOfPLights(); i++)
+		m_pointLights.push_back(scenePtr->pLight(i));
+	m_pointLights.insert (m_pointLights.end (), m_areaLights.begin (), m_areaLights.end ());
+	m_pointLights.insert (m_pointLights.end (), m_vpls.begin (), m_vpls.end ());
+	if (useLightCuts) {
+		if (!initLightCuts(scenePtr, invModelViewMatrix, token))
+			return false;
+		m_generatedLightsChanged = false;
 	}
-	std::chrono::time_point<std::chrono::high_resolution_clock> after = clock.now();
-	double elapsedTime = (double)std::chrono::duration_cast<std::chrono::milliseconds>(after - before).count();
+	return true;
+}
+
+void RayTracer::endFrame (double elapsedTime) {
+	size_t width, height;
+	renderSize (width, height);
+	long long pixelCount = (long long)(width - 1) * (long long)(height - 1);
 	Console::print ("Ray tracing executed in " + std::to_string(elapsedTime) + "ms");
+	if (adaptiveSampling)
+		std::cout << 1.0 * samplesPerFrame / std::max (1ll, pixelCount) << " camera rays per pixel on average" << std::endl;
 	if (useLightCuts) {
-		std::cout << 1.0 * sumLightsPerRay / cntLightsPerRay << " light sources evaluated on average" << std::endl;
+		std::cout << 1.0 * sumLightsPerRay / std::max (1ll, cntLightsPerRay.load ()) << " light sources evaluated on average" << std::endl;
+		std::cout << "light budget hit on " << 100.0 * budgetHitsPerFrame / std::max (1ll, pixelCount) << "% of pixels" << std::endl;
+		if (outOfCoreGeometry)
+			std::cout << outOfCoreGeometry->treeletLoads << " treelet loads, " << outOfCoreGeometry->treeletEvictions << " evictions, " << (outOfCoreGeometry->peakResidentBytes >> 20) << "MB resident at most" << std::endl;
+		if (visibilityCaching)
+			std::cout << 100.0 * shadowRaysCached / std::max (1ll, shadowRaysTraced + shadowRaysCached) << "% of shadow rays answered by the visibility cache" << std::endl;
+	}
+}
+
+void RayTracer::renderProgressive (const std::shared_ptr<Scene> scenePtr, int workerCount) {
+	cancel ();
+	if (!m_renderImagePtr || m_renderImagePtr->width () != m_imagePtr->width () || m_renderImagePtr->height () != m_imagePtr->height ())
+		m_renderImagePtr = std::make_shared<Image> (m_imagePtr->width (), m_imagePtr->height ());
+	m_renderImagePtr->clear (scenePtr->backgroundColor ());
+	m_job = std::make_shared<RenderJob> ();
+	m_job->signature = jobSignature (scenePtr);
+	m_job->invModelViewMatrix = beginFrame (scenePtr);
+	size_t width, height;
+	renderSize (width, height);
+	for (size_t y = 0; y < height - 1; y += TILE_SIZE)
+		for (size_t x = 0; x < width - 1; x += TILE_SIZE)
+			m_job->tiles.push_back (RenderTile{x, y, std::min (x + TILE_SIZE, width - 1), std::min (y + TILE_SIZE, height - 1)});
+	m_job->tileStep.assign (m_job->tiles.size (), 0);
+	if (adaptiveSampling) {
+		m_job->tileSamples.assign (m_job->tiles.size (), 1);
+		m_job->tileConverged.assign (m_job->tiles.size (), 0);
+		m_job->samples.assign (m_imagePtr->width () * m_imagePtr->height (), PixelSamples ());
+		if (!m_sampleImagePtr || m_sampleImagePtr->width () != m_imagePtr->width () || m_sampleImagePtr->height () != m_imagePtr->height ())
+			m_sampleImagePtr = std::make_shared<Image> (m_imagePtr->width (), m_imagePtr->height ());
+		if (m_sampleCountImagePtr->width () != m_imagePtr->width () || m_sampleCountImagePtr->height () != m_imagePtr->height ())
+			m_sampleCountImagePtr = std::make_shared<Image> (m_imagePtr->width (), m_imagePtr->height ());
+		m_sampleCountImagePtr->clear ();
+	}
+	runJob (scenePtr, workerCount);
+}
+
+void RayTracer::restart (const std::shared_ptr<Scene> scenePtr, int workerCount) {
+	if (m_job && m_job->signature == jobSignature (scenePtr)) {
+		if (m_job->finished || isRendering ())
+			return;
+		Console::print ("Resuming ray tracing from the completed tiles...");
+		cancel ();
+		runJob (scenePtr, workerCount);
+		return;
+	}
+	renderProgressive (scenePtr, workerCount);
+}
+
+void RayTracer::runJob (const std::shared_ptr<Scene> scenePtr, int workerCount) {
+	if (workerCount <= 0)
+		workerCount = std::max (1u, std::thread::hardware_concurrency ());
+	std::shared_ptr<RenderJob> job = m_job;
+	std::shared_ptr<CancellationToken> token = std::make_shared<CancellationToken> ();
+	job->token = token;
+	m_rendering = true;
+	m_worker = std::thread ([this, scenePtr, job, token, workerCount] () {
+		std::chrono::high_resolution_clock clock;
+		std::chrono::time_point<std::chrono::high_resolution_clock> before = clock.now();
+		// the frame setup is done here rather than by the caller, once per job
+		if (!job->prepared)
+			job->prepared = prepareFrame (scenePtr, job->invModelViewMatrix, token.get ());
+		if (!job->prepared) {
+			m_rendering = false;
+			return;
+		}
+		// the wavefront pipeline renders the full resolution pass at once, publishing each batch;
+		// it is the only one to trace the paged geometry when there is nothing in core
+		bool inCore = !outOfCoreOnly (scenePtr);
+		bool wavefrontPass = useLightCuts && (wavefront || !inCore);
+		if (wavefrontPass && std::any_of (job->tileStep.begin (), job->tileStep.end (), [] (size_t step) { return step != 1; })) {
+			size_t width, height;
+			renderSize (width, height);
+			renderWavefront (width, height, token.get ());
+			if (!token->cancelled)
+				std::fill (job->tileStep.begin (), job->tileStep.end (), 1);
+		}
+		// otherwise 1/16 of the pixels, then 1/4, then all of them; tiles already through a pass in a previous run are skipped
+		for (size_t step : {4, 2, 1}) {
+			if (wavefrontPass)
+				break;
+			std::atomic<size_t> next (0);
+			std::vector<std::thread> workers;
+			for (int i = 0; i < workerCount; i++) {
+				workers.emplace_back ([&] () {
+					for (size_t t = next++; t < job->tiles.size () && !token->cancelled; t = next++) {
+						if (job->tileStep[t] != 0 && job->tileStep[t] <= step)
+							continue;
+						renderTile (scenePtr, job->tiles[t], job->invModelViewMatrix, step, job->tileStep[t]);
+						job->tileStep[t] = step;
+						publishTile (job->tiles[t]);
+					}
+				});
+			}
+			for (auto & worker : workers)
+				worker.join ();
+			if (token->cancelled)
+				break;
+		}
+		// then one more sample per pass for the pixels of the tiles whose noise is still above the threshold;
+		// each pass brings the tiles that are the furthest behind one sample further, so a resumed job carries on
+		while (adaptiveSampling && inCore && !token->cancelled) {
+			int sample = adaptiveMaxSamples + 1;
+			for (size_t t = 0; t < job->tiles.size (); t++)
+				if (!job->tileConverged[t])
+					sample = std::min (sample, job->tileSamples[t] + 1);
+			if (sample > adaptiveMaxSamples)
+				break;
+			std::atomic<size_t> next (0);
+			std::vector<std::thread> workers;
+			for (int i = 0; i < workerCount; i++) {
+				workers.emplace_back ([&] () {
+					for (size_t t = next++; t < job->tiles.size () && !token->cancelled; t = next++) {
+						if (job->tileConverged[t] || job->tileSamples[t] >= sample)
+							continue;
+						job->tileConverged[t] = refineTile (scenePtr, *job, t);
+						publishTile (job->tiles[t]);
+					}
+				});
+			}
+			for (auto & worker : workers)
+				worker.join ();
+		}
+		std::chrono::time_point<std::chrono::high_resolution_clock> after = clock.now();
+		job->elapsedTime += (double)std::chrono::duration_cast<std::chrono::milliseconds>(after - before).count();
+		if (!token->cancelled) {
+			job->finished = true;
+			endFrame (job->elapsedTime);
+		}
+		m_rendering = false;
+	});
+}
+
+void RayTracer::cancel () {
+	if (m_job && m_job->token)
+		m_job->token->cancelled = true;
+	if (m_worker.joinable ())
+		m_worker.join ();
+	m_rendering = false;
+}
+
+std::vector<float> RayTracer::jobSignature (const std::shared_ptr<Scene> scenePtr) const {
+	size_t width, height;
+	renderSize (width, height);
+	auto camera = scenePtr->camera ();
+	glm::mat4 viewMatrix = camera->computeViewMatrix ();
+	std::vector<float> signature{(float)width, (float)height, camera->getFoV (), camera->getAspectRatio (), camera->getNear (), camera->getFar (), (float)wavefront};
+	signature.insert (signature.end (), glm::value_ptr (viewMatrix), glm::value_ptr (viewMatrix) + 16);
+	glm::vec3 background = scenePtr->backgroundColor ();
+	signature.insert (signature.end (), {background[0], background[1], background[2]});
+	signature.insert (signature.end (), {(float)useLightCuts, (float)lightCutsSampling, (float)lightCutsOnlyDiffuse, (float)lightCutsStochasticSize, lightCutsErrorRatio, (float)lightCutsMaxCutSize, (float)frameShadowRayBudget, (float)lightCutsCoherentReuse});
+	signature.insert (signature.end (), {(float)vplSettings.count, (float)vplSettings.maxBounces, vplSettings.clamp, (float)vplSettings.seed, (float)areaLightSampleCount});
+	signature.insert (signature.end (), {(float)visibilityCaching, (float)visibilityCacheMinSamples, (float)visibilityCacheValidation, (float)batchShadowRays});
+	signature.insert (signature.end (), {(float)adaptiveSampling, (float)adaptiveMinSamples, (float)adaptiveMaxSamples, adaptiveThreshold, adaptiveLuminanceFloor});
+	for (size_t i = 0; i < scenePtr->numOfPLights (); i++) {
+		auto light = scenePtr->pLight (i);
+		glm::vec3 p = light->getTranslation ();
+		signature.insert (signature.end (), {p[0], p[1], p[2], light->color[0], light->color[1], light->color[2], light->intensity, light->normal[0], light->normal[1], light->normal[2]});
+	}
+	for (size_t i = 0; i < scenePtr->numOfLights (); i++) {
+		auto light = scenePtr->light (i);
+		signature.insert (signature.end (), {light->direction[0], light->direction[1], light->direction[2], light->color[0], light->color[1], light->color[2], light->intensity});
+	}
+	if (auto environment = scenePtr->environment ())
+		signature.insert (signature.end (), {environment->intensity, (float)environment->sampleCount, (float)environment->radiance->width (), (float)environment->radiance->height ()});
+	for (size_t i = 0; i < scenePtr->numOfMeshes (); i++) {
+		auto model = scenePtr->mesh (i);
+		glm::vec3 sum (0.f);
+		for (const auto & p : model->mesh->vertexPositions ())
+			sum += p;
+		signature.insert (signature.end (), {(float)model->mesh->triangleIndices ().size (), sum[0], sum[1], sum[2], (float)model->ranges.size ()});
+		auto addMaterial = [&] (const Material & m) {
+			signature.insert (signature.end (), {m.albedo[0], m.albedo[1], m.albedo[2], m.shininess, m.roughness, m.kd, m.ka, m.ks, m.emission[0], m.emission[1], m.emission[2]});
+		};
+		addMaterial (*model->material);
+		for (const auto & range : model->ranges) {
+			signature.insert (signature.end (), {(float)range.first, (float)range.count});
+			addMaterial (*range.material);
+		}
+	}
+	return signature;
+}
+
+void RayTracer::publishTile (const RenderTile & tile) {
+	std::lock_guard<std::mutex> lock (m_displayMutex);
+	for (size_t y = tile.y0; y < tile.y1; y++)
+		for (size_t x = tile.x0; x < tile.x1; x++)
+			(*m_imagePtr)(x, y) = (*m_renderImagePtr)(x, y);
+	if (!m_dirty) {
+		m_dirtyRegion = tile;
+		m_dirty = true;
+	} else {
+		m_dirtyRegion = RenderTile{std::min (m_dirtyRegion.x0, tile.x0), std::min (m_dirtyRegion.y0, tile.y0), std::max (m_dirtyRegion.x1, tile.x1), std::max (m_dirtyRegion.y1, tile.y1)};
+	}
+}
+
+bool RayTracer::publishDirty (const std::function<void (const Image &, const RenderTile &)> & upload, bool everything) {
+	std::lock_guard<std::mutex> lock (m_displayMutex);
+	if (everything) {
+		m_dirtyRegion = RenderTile{0, 0, m_imagePtr->width (), m_imagePtr->height ()};
+		m_dirty = true;
 	}
+	if (!m_dirty)
+		return false;
+	upload (*m_imagePtr, m_dirtyRegion);
+	m_dirty = false;
+	return true;
 }
 
 
@@ -14,6 +14,11 @@
 #include <limits>
 #include <memory>
 #include <chrono>
+#include <unordered_map>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <functional>
 
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
@@ -21,29 +26,249 @@
 #include "Image.h"
 #include "Scene.h"
 #include "LightCut.hpp"
+#include "VirtualLights.hpp"
+#include "AreaLights.hpp"
+#include "SceneGeometry.hpp"
+#include "OutOfCoreGeometry.hpp"
 
 using namespace std;
 
+/// Pixel range [x0, x1) x [y0, y1) rendered as a unit.
+struct RenderTile {
+	size_t x0;
+	size_t y0;
+	size_t x1;
+	size_t y1;
+};
+
+static const size_t TILE_SIZE = 16;
+
+/// Stop request shared by the threads of a render job, checked before each tile.
+struct CancellationToken {
+	std::atomic<bool> cancelled {false};
+};
+
+/// Samples of one pixel accumulated across the adaptive passes: running mean, and Welford sum of squared deviations
+/// of their luminance for the variance.
+struct PixelSamples {
+	glm::vec3 mean {0.f};
+	float luminanceMean = 0.f;
+	float m2 = 0.f;
+	int count = 0;
+	bool converged = false;
+	void add (const glm::vec3 & sample);
+	/// Standard error of the mean luminance, relative to the mean (with floor for dark pixels).
+	float relativeError (float floor) const;
+};
+
+/// Progressive render of one frame: the inputs it was started for, its cancellation token and how far each tile got.
+/// A cancelled job keeps its tiles, restarting it with the same inputs only renders what is missing.
+struct RenderJob {
+	std::vector<float> signature; // see RayTracer::jobSignature
+	std::shared_ptr<CancellationToken> token;
+	std::vector<RenderTile> tiles;
+	std::vector<size_t> tileStep; // step of the finest pass completed by each tile, 0 before the first one
+	std::vector<int> tileSamples; // samples per pixel taken by each tile, adaptive passes only
+	std::vector<unsigned char> tileConverged; // every pixel of the tile converged, see RayTracer::adaptiveThreshold
+	std::vector<PixelSamples> samples; // per pixel, adaptive passes only
+	glm::mat3 invModelViewMatrix;
+	bool prepared = false; // frame setup done, see RayTracer::prepareFrame
+	double elapsedTime = 0.0; // milliseconds spent over all the runs
+	bool finished = false;
+};
+
+/// Shadow ray outcomes of one tile, keyed by (surface patch, light tree node). Rays towards a node seen fully lit or
+/// fully occluded are answered from the cache except for periodic validation rays; nodes with mixed outcomes lie on
+/// a shadow boundary and are always traced.
+struct VisibilityCache {
+	struct Entry {
+		int lit = 0;
+		int occluded = 0;
+		int uses = 0;
+	};
+	/// 1 if lit, 0 if occluded, -1 when a shadow ray has to be traced.
+	int lookup (int node, const glm::vec3 & normal);
+	void record (int node, const glm::vec3 & normal, bool lit);
+
+	int minSamples = 4;
+	int validationPeriod = 8;
+	std::unordered_map<long long, Entry> entries;
+};
+
+/// Closest hit of the ray against the geometry, without its shading data (see SceneGeometry::resolveSurface).
+HitRecord raySceneClosestHitBVH (Ray ray, const SceneGeometry & geometry);
+/// Closest hit with its shading data.
+RayHit raySceneIntersectionBVH (Ray ray, const SceneGeometry & geometry);
+/// True if something lies on the ray before maxT (distance along the normalized ray).
+bool raySceneOcclusionBVH (Ray ray, float maxT, const SceneGeometry & geometry);
+
+/// Shadow ray waiting in a tile queue: its contribution is added to the pixel if it reaches the light.
+struct ShadowRayRequest {
+	Ray ray;
+	float maxT;
+	glm::vec3 contribution;
+	size_t pixel;
+	int node; // light tree node, for the visibility cache
+	glm::vec3 normal;
+	int order; // direction octant then light node, rays of a batch are traced in this order
+};
+
+/// Structure of arrays of one wavefront batch: camera rays and hits indexed by ray, shadow rays indexed by shadow ray.
+struct WavefrontBuffers {
+	AlignedVector<size_t> pixel;
+	AlignedVector<glm::vec3> origin;
+	AlignedVector<glm::vec3> direction;
+	AlignedVector<float> t;
+	AlignedVector<glm::vec3> normal;
+	AlignedVector<int> material; // index in the materials of the traced geometry, as HitRecord::material, -1 for a miss
+	AlignedVector<int> cutThread; // cut stage thread of the ray, whose output holds its cut from cutOffset
+	AlignedVector<size_t> cutOffset;
+	AlignedVector<size_t> firstShadowRay; // cut lights and shadow rays of ray i are [firstShadowRay[i], firstShadowRay[i + 1])
+	AlignedVector<LightSample> cut;
+	AlignedVector<glm::vec3> shadowOrigin;
+	AlignedVector<glm::vec3> shadowDirection;
+	AlignedVector<float> shadowMaxT;
+	AlignedVector<glm::vec3> shadowContribution;
+	AlignedVector<unsigned char> occluded;
+};
+
 class RayTracer {
 public:
 	
-	RayTracer(bool useLightCuts = false, bool renderPreview = false, bool lightCutsSampling = false, bool lightCutsOnlyDiffuse = false);
+	RayTracer(bool useLightCuts = false, bool renderPreview = false, bool lightCutsSampling = false, bool lightCutsOnlyDiffuse = false, int lightCutsStochasticSize = 0);
 	virtual ~RayTracer();
 
-	inline void setResolution (int width, int height) { m_imagePtr = make_shared<Image> (width, height); }
+	inline void setResolution (int width, int height) { cancel (); m_imagePtr = make_shared<Image> (width, height); }
+	/// Displayed image. A progressive render publishes its tiles into it, see publishDirty.
 	inline std::shared_ptr<Image> image () { return m_imagePtr; }
+	/// Pixels where the light cut was stopped by the light budget are set to 1.
+	inline std::shared_ptr<Image> budgetImage () { return m_budgetImagePtr; }
+	/// Heatmap of the samples per pixel taken by adaptive sampling, from blue (one) to red (adaptiveMaxSamples).
+	inline std::shared_ptr<Image> sampleCountImage () { return m_sampleCountImagePtr; }
+	/// Resolution actually rendered: the image one, divided by 4 along each axis for preview tracers.
+	void renderSize (size_t & width, size_t & height) const;
+	/// Error target of the adaptive cut, max lights per shading point and total shadow rays per frame (0 for no limit).
+	void setLightCutBudget (float errorRatio, int maxCutSize, long long frameShadowRayBudget = 0);
 	void init (const std::shared_ptr<Scene> scenePtr);
-	void render (const std::shared_ptr<Scene> scenePtr);
-	void initLightCuts(const std::shared_ptr<Scene> scenePtr);
-	glm::vec3 GetPointLightCuts(const std::shared_ptr<Scene> scenePtr, Ray ray, RayHit hit, bool print = false);
+	/// Starts rendering in background threads and returns at once. Passes go from one pixel out of 16 (4x4 blocks)
+	/// to one out of 4 and to full resolution; tiles are rendered by workerCount threads (hardware concurrency if 0)
+	/// into a back image and published to image () as they complete. A running render is cancelled first.
+	/// The frame setup (BVH, generated lights, light tree) runs in the background thread too. With wavefront light
+	/// cuts, the full resolution pass is rendered by renderWavefront instead of the tile passes.
+	void renderProgressive (const std::shared_ptr<Scene> scenePtr, int workerCount = 0);
+	/// Restart-on-change: starts a new progressive render if anything the image depends on changed since the last
+	/// one, resumes it from its completed tiles if it was cancelled, and does nothing if it is running or done.
+	void restart (const std::shared_ptr<Scene> scenePtr, int workerCount = 0);
+	/// Stops a progressive render after the tiles in flight and waits for its threads. The job can be resumed by restart.
+	void cancel ();
+	inline bool isRendering () const { return m_rendering; }
+	/// True once a progressive render was started.
+	inline bool hasJob () const { return m_job != nullptr; }
+	/// Calls upload with image () and the region published since the previous call (all of it if everything is set),
+	/// holding the display lock. Returns false without calling upload when nothing changed.
+	bool publishDirty (const std::function<void (const Image &, const RenderTile &)> & upload, bool everything = false);
+	/// Builds or refits the light tree. Returns false, with the tree left for the next frame to rebuild, once token is cancelled.
+	bool initLightCuts(const std::shared_ptr<Scene> scenePtr, const glm::mat3 & invModelViewMatrix, const CancellationToken * token = nullptr);
+	glm::vec3 GetPointLightCuts(Ray ray, RayHit hit, std::mt19937& rng, int budget = -1, bool* budgetHit = nullptr, std::vector<int>* coherentCut = nullptr, VisibilityCache* visibility = nullptr, std::vector<ShadowRayRequest>* shadowQueue = nullptr, size_t pixel = 0, bool print = false);
 
 	bool useLightCuts;
 	bool renderPreview;
 	bool lightCutsSampling;
 	bool lightCutsOnlyDiffuse;
-	int sumLightsPerRay = 0;
-	int cntLightsPerRay = 0;
+	int lightCutsStochasticSize; // fixed cut size of stochastic lightcuts, 0 for the adaptive cut
+	unsigned int frameIndex = 0;
+	float lightCutsErrorRatio = 0.007f;
+	int lightCutsMaxCutSize = 1000;
+	long long frameShadowRayBudget = 0;
+	std::atomic<long long> budgetHitsPerFrame {0};
+	bool lightCutsCoherentReuse = false; // seed each cut from the previous pixel of the tile
+	std::atomic<long long> sumLightsPerRay {0};
+	std::atomic<long long> cntLightsPerRay {0};
+	VPLSettings vplSettings; // indirect lighting through virtual point lights, disabled by default
+	int areaLightSampleCount = 4096; // point lights spread over the emissive triangles
+	bool visibilityCaching = false; // reuse shadow ray outcomes per light cluster inside a tile
+	int visibilityCacheMinSamples = 4;
+	int visibilityCacheValidation = 8; // one cached answer out of this many is still checked with a ray
+	std::atomic<long long> shadowRaysTraced {0};
+	bool batchShadowRays = false; // queue shadow rays per tile and trace them sorted, as a batch
+	size_t shadowQueueCapacity = 4096; // queued rays flushed at this size and at the end of each tile
+	bool wavefront = false; // breadth-first light cut rendering, see renderWavefront
+	size_t wavefrontBatchSize = 1 << 16; // camera rays per wavefront batch
+	// paged scene geometry, traced instead of the in-core BVH by the closest hit and shadow stages of the wavefront
+	// pipeline; the in-core BVH is then not built for frames rendered by it without VPLs. When the scene has no
+	// mesh of its own, light cut frames always go through the wavefront pipeline, without VPLs or adaptive samples,
+	// and tracers without light cuts render nothing
+	std::shared_ptr<OutOfCoreGeometry> outOfCoreGeometry;
+	std::atomic<long long> shadowRaysCached {0};
+	bool adaptiveSampling = false; // after the full resolution pass, resample the noisy pixels of the progressive render
+	int adaptiveMinSamples = 4; // samples per pixel before its variance is trusted
+	int adaptiveMaxSamples = 32;
+	float adaptiveThreshold = 0.02f; // relative standard error below which a pixel stops being sampled
+	float adaptiveLuminanceFloor = 0.05f; // dark pixels are compared to this luminance instead of their own
+	std::atomic<long long> samplesPerFrame {0};
 
 private:
+	/// Renders one pixel out of step x step and fills the block it starts, skipping pixels of the previousStep pass.
+	/// A sample > 0 renders that extra jittered sample of the pixels not converged in samples, into m_sampleImagePtr.
+	void renderTile (const std::shared_ptr<Scene> scenePtr, const RenderTile & tile, const glm::mat3 & invModelViewMatrix, size_t step = 1, size_t previousStep = 0, unsigned int sample = 0, const std::vector<PixelSamples> * samples = nullptr);
+	/// Renders one more sample of the unconverged pixels of a job tile and folds it into their running means.
+	/// Returns true once every pixel of the tile converged.
+	bool refineTile (const std::shared_ptr<Scene> scenePtr, RenderJob & job, size_t tile);
+	/// Per frame setup of renderProgressive, cheap enough for the caller's thread: counters and
+	/// camera rays. Returns the inverse view rotation.
+	glm::mat3 beginFrame (const std::shared_ptr<Scene> scenePtr);
+	/// Rest of the frame setup: BVH (rebuilt only when the geometry changed), generated lights, light tree.
+	/// Stops between stages and returns false once token is cancelled.
+	bool prepareFrame (const std::shared_ptr<Scene> scenePtr, const glm::mat3 & invModelViewMatrix, const CancellationToken * token = nullptr);
+	void endFrame (double elapsedTime);
+	void publishTile (const RenderTile & tile);
+	/// Everything the pixels depend on: resolution, camera, lighting settings, lights, geometry and materials.
+	/// Settings of the display are left out.
+	std::vector<float> jobSignature (const std::shared_ptr<Scene> scenePtr) const;
+	/// Renders the tiles of m_job missing from each pass in a background thread, until done or cancelled.
+	void runJob (const std::shared_ptr<Scene> scenePtr, int workerCount);
+	/// Light cut rendering stage by stage over batches of wavefrontBatchSize pixels: camera rays, closest hits, cuts,
+	/// shadow rays any-hit, accumulation. Every stage is an OpenMP loop over the SoA buffers. The frame light budget
+	/// is shared between the cuts as in the tile path; cut reuse, visibility caching and shadow ray batching belong
+	/// to the tile path and are not used here.
+	/// With outOfCoreGeometry, the hits of a stage are traced as one batch queued per treelet.
+	/// Each batch is published once done; a cancelled token stops the pipeline before the next batch.
+	void renderWavefront (size_t width, size_t height, const CancellationToken * token = nullptr);
+	/// Resamples the emissive triangles when their geometry, emission or the sample count changed. Returns true if so.
+	bool updateAreaLights (const std::shared_ptr<Scene> scenePtr);
+	/// Traces the queued shadow rays in sorted order and accumulates the unoccluded ones into the image.
+	void flushShadowRays (std::vector<ShadowRayRequest> & queue, VisibilityCache * visibility, Image & image);
+	/// True when the paged geometry is all there is to trace, the in-core BVH being empty.
+	inline bool outOfCoreOnly (const std::shared_ptr<Scene> scenePtr) const { return outOfCoreGeometry && scenePtr->numOfMeshes () == 0; }
+	/// Regenerates the VPLs when the emitters or the settings changed since the previous frame. Returns true if so.
+	/// A generation stopped by token is dropped and started over by the next frame.
+	bool updateVirtualLights (const std::shared_ptr<Scene> scenePtr, const glm::mat3 & invModelViewMatrix, const CancellationToken * token = nullptr);
+
 	std::shared_ptr<Image> m_imagePtr;
+	std::shared_ptr<Image> m_budgetImagePtr;
+	std::shared_ptr<Image> m_renderImagePtr; // back buffer written by the tiles, copied to image () as they complete
+	std::shared_ptr<Image> m_sampleImagePtr; // extra samples of adaptive sampling, before they are folded into the means
+	std::shared_ptr<Image> m_sampleCountImagePtr;
+	CameraRayGenerator m_cameraRays;
+	std::atomic<long long> m_remainingShadowRays {0};
+	std::atomic<long long> m_remainingPixels {0};
+	std::thread m_worker;
+	std::shared_ptr<RenderJob> m_job;
+	std::atomic<bool> m_rendering {false};
+	std::mutex m_displayMutex;
+	RenderTile m_dirtyRegion {0, 0, 0, 0};
+	bool m_dirty = false;
+	std::vector<LightCutScratch> m_threadScratch;
+	std::vector<std::vector<LightSample>> m_threadCuts; // lights appended by each thread of the wavefront cut stage
+	std::vector<BRDF> m_materialBrdfs; // BRDF of each material of the geometry traced by the wavefront pipeline
+	WavefrontBuffers m_wavefront;
+	std::vector<std::shared_ptr<PointLight>> m_areaLights;
+	std::vector<float> m_areaLightSignature;
+	std::vector<std::shared_ptr<PointLight>> m_vpls;
+	std::vector<float> m_vplSignature;
+	bool m_generatedLightsChanged = false;
+	std::vector<std::shared_ptr<PointLight>> m_pointLights; // scene point lights, area light samples, then the VPLs
+	// owned by each tracer, so that a job resumed after another tracer rendered still finds its own frame setup
+	SceneGeometry m_geometry;
+	LightTree m_lightTree;
 };
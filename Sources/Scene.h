@@ -11,6 +11,7 @@
 #include <vector>
 #include <memory>
 #include <unordered_map>
+#include <algorithm>
 
 #include "Camera.h"
 #include "Mesh.h"
@@ -36,12 +37,16 @@ public:
 
 	inline void add (std::shared_ptr<DirectionalLight> lightSource) { m_lights.push_back (lightSource); }
 	inline void add (std::shared_ptr<PointLight> lightSource) { m_plights.push_back (lightSource); }
+	inline void set (std::shared_ptr<EnvironmentLight> environment) { m_environment = environment; }
+	inline void remove (std::shared_ptr<PointLight> lightSource) { m_plights.erase (std::remove (m_plights.begin (), m_plights.end (), lightSource), m_plights.end ()); }
 
 	inline const std::shared_ptr<Model> mesh (size_t index) const { return m_meshes[index]; }
 
 	inline std::shared_ptr<Model> mesh (size_t index) { return m_meshes[index]; }
 	inline std::shared_ptr<DirectionalLight> light (size_t index) { return m_lights[index]; }
 	inline std::shared_ptr<PointLight> pLight (size_t index) { return m_plights[index]; }
+	/// Environment map lighting the scene, null if none.
+	inline std::shared_ptr<EnvironmentLight> environment () { return m_environment; }
 
 
 	inline size_t numOfMeshes() {return m_meshes.size();}
@@ -52,6 +57,7 @@ public:
 		m_camera.reset ();
 		m_meshes.clear ();
 		m_lights.clear ();
+		m_environment.reset ();
 	}
 
 private:
@@ -59,5 +65,6 @@ private:
 	std::shared_ptr<Camera> m_camera;
 	std::vector<std::shared_ptr<DirectionalLight>> m_lights;
 	std::vector<std::shared_ptr<PointLight>> m_plights;
+	std::shared_ptr<EnvironmentLight> m_environment;
 	std::vector<std::shared_ptr<Model> > m_meshes;
 };
\ No newline at end of file
@@ -0,0 +1,129 @@
+#include "SceneGeometry.hpp"
+#include <cstring>
+#include <unordered_map>
+
+namespace {
+
+/// The views point into the mesh arrays, so their addresses are part of it besides their content.
+std::vector<std::uintptr_t> geometrySignature(const std::shared_ptr<Scene> scenePtr) {
+    std::vector<std::uintptr_t> signature;
+    for (size_t i = 0; i < scenePtr->numOfMeshes(); i++) {
+        const auto& model = scenePtr->mesh(i);
+        const auto& positions = model->mesh->vertexPositions();
+        glm::vec3 sum(0.0f);
+        for (const auto& p : positions) {
+            sum += p;
+        }
+        std::uint32_t bits[3];
+        std::memcpy(bits, &sum[0], sizeof(bits));
+        signature.insert(signature.end(), {(std::uintptr_t)positions.data(), positions.size(), (std::uintptr_t)model->mesh->vertexNormals().data(),
+            (std::uintptr_t)model->mesh->triangleIndices().data(), model->mesh->triangleIndices().size(), bits[0], bits[1], bits[2],
+            (std::uintptr_t)model->material.get(), model->ranges.size()});
+        for (const auto& range : model->ranges) {
+            signature.insert(signature.end(), {range.first, range.count, (std::uintptr_t)range.material.get()});
+        }
+    }
+    return signature;
+}
+
+}
+
+bool SceneGeometry::isUpToDate(const std::shared_ptr<Scene> scenePtr) const {
+    return !signature.empty() && signature == geometrySignature(scenePtr);
+}
+
+void SceneGeometry::build(const std::shared_ptr<Scene> scenePtr) {
+    signature = geometrySignature(scenePtr);
+    meshes.clear();
+    triangleMesh.clear();
+    triangleIndex.clear();
+    triangleMaterial.clear();
+    materials.clear();
+    std::unordered_map<const Material*, int> materialIndex;
+    auto addMaterial = [&](const std::shared_ptr<Material>& material) {
+        auto inserted = materialIndex.emplace(material.get(), (int)materials.size());
+        if (inserted.second) {
+            materials.push_back(material);
+        }
+        return inserted.first->second;
+    };
+    std::vector<std::vector<glm::vec3>> triPos;
+    for (int i = 0; i < (int)scenePtr->numOfMeshes(); i++) {
+        const auto& model = scenePtr->mesh(i);
+        const auto& positions = model->mesh->vertexPositions();
+        const auto& triangles = model->mesh->triangleIndices();
+        meshes.push_back(MeshView{ConstSpan<glm::vec3>(positions), ConstSpan<glm::vec3>(model->mesh->vertexNormals()), ConstSpan<glm::uvec3>(triangles)});
+        int material = addMaterial(model->material);
+        size_t range = 0;
+        for (int j = 0; j < (int)triangles.size(); j++) {
+            triPos.push_back({positions[triangles[j][0]], positions[triangles[j][1]], positions[triangles[j][2]]});
+            triangleMesh.push_back(i);
+            triangleIndex.push_back(j);
+            // ranges are sorted, walked along with the triangles
+            for (; range < model->ranges.size() && (size_t)j >= model->ranges[range].first; range++) {
+                material = addMaterial(model->ranges[range].material);
+            }
+            triangleMaterial.push_back(material);
+        }
+    }
+    bvh.reset();
+    if (triPos.empty()) {
+        return;
+    }
+    bvh = std::make_unique<BVH<std::vector<glm::vec3>>>(std::move(triPos));
+    bvh->build();
+}
+
+HitRecord SceneGeometry::closestHit(const Ray& ray) const {
+    HitRecord hit;
+    if (!bvh) {
+        return hit;
+    }
+    bvh->checkHit(0, ray, [&](int idx) {
+        const MeshView& view = meshes[triangleMesh[idx]];
+        const glm::uvec3& triangle = view.triangles[triangleIndex[idx]];
+        float t;
+        glm::vec2 barycentrics;
+        // only the nearest candidate is kept, its shading data is computed by resolveSurface
+        if (rayTriangleIntersect(ray, view.positions[triangle[0]], view.positions[triangle[1]], view.positions[triangle[2]], t, barycentrics) && (hit.t == -1 || t < hit.t)) {
+            hit.t = t;
+            hit.prim = triangleIndex[idx];
+            hit.mesh = triangleMesh[idx];
+            hit.material = triangleMaterial[idx];
+            hit.barycentrics = barycentrics;
+        }
+    });
+    return hit;
+}
+
+bool SceneGeometry::occluded(const Ray& ray, float maxT) const {
+    if (!bvh) {
+        return false;
+    }
+    return bvh->checkAnyHit(0, ray, maxT, [&](int idx) {
+        const MeshView& view = meshes[triangleMesh[idx]];
+        const glm::uvec3& triangle = view.triangles[triangleIndex[idx]];
+        float t;
+        return rayTriangleIntersect(ray, view.positions[triangle[0]], view.positions[triangle[1]], view.positions[triangle[2]], t) && t < maxT;
+    });
+}
+
+glm::vec3 SceneGeometry::shadingNormal(const HitRecord& record) const {
+    const MeshView& view = meshes[record.mesh];
+    const glm::uvec3& triangle = view.triangles[record.prim];
+    glm::vec3 uvw(1.0f - record.barycentrics[0] - record.barycentrics[1], record.barycentrics[0], record.barycentrics[1]);
+    glm::vec3 normal = view.normals[triangle[0]] * uvw[0] + view.normals[triangle[1]] * uvw[1] + view.normals[triangle[2]] * uvw[2];
+    return normal / glm::length(normal);
+}
+
+RayHit SceneGeometry::resolveSurface(const HitRecord& record, const Ray& ray) const {
+    RayHit hit;
+    if (record.t == -1) {
+        return hit;
+    }
+    hit.brdf = BRDF(materials[record.material]);
+    hit.normal = shadingNormal(record);
+    hit.ray = ray;
+    hit.t = record.t;
+    return hit;
+}
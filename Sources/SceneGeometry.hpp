@@ -0,0 +1,53 @@
+#pragma once
+#include "BVH.hpp"
+#include "Ray.hpp"
+#include "Scene.h"
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/// Read-only view of a contiguous array, valid as long as the array is not resized.
+template<typename T>
+struct ConstSpan {
+    ConstSpan() {}
+    ConstSpan(const std::vector<T>& v): data(v.data()), size(v.size()) {}
+    inline const T& operator[](size_t i) const { return data[i]; }
+    const T* data = nullptr;
+    size_t size = 0;
+};
+
+/// Geometry of one model as read by the intersection code: spans over its own mesh arrays, so that a ray copies
+/// neither index buffers nor shared pointers.
+struct MeshView {
+    ConstSpan<glm::vec3> positions;
+    ConstSpan<glm::vec3> normals;
+    ConstSpan<glm::uvec3> triangles;
+};
+
+/// Registry of the scene geometry for ray tracing: one view per model and a single BVH over the triangles of all
+/// of them, so that a ray is traced in one traversal whatever the number of models. Rebuilt once per render.
+struct SceneGeometry {
+    void build(const std::shared_ptr<Scene> scenePtr);
+    /// True if build would give the same geometry: same mesh arrays, vertex sums, materials and ranges.
+    bool isUpToDate(const std::shared_ptr<Scene> scenePtr) const;
+    /// Closest hit of the normalized ray, without its shading data. HitRecord::mesh is the model index in the scene.
+    /// HitRecord::material indexes materials.
+    HitRecord closestHit(const Ray& ray) const;
+    /// True if something lies on the normalized ray before maxT.
+    bool occluded(const Ray& ray, float maxT) const;
+    /// Shading data of a hit: interpolated normal and BRDF.
+    RayHit resolveSurface(const HitRecord& record, const Ray& ray) const;
+    /// Interpolated unit normal of a hit.
+    glm::vec3 shadingNormal(const HitRecord& record) const;
+    inline size_t triangleCount() const { return triangleMesh.size(); }
+
+    std::vector<MeshView> meshes;
+    // BVH primitive -> model and triangle in that model
+    std::vector<int> triangleMesh;
+    std::vector<int> triangleIndex;
+    std::vector<int> triangleMaterial;
+    // distinct materials of the models and of their ranges, only copied into the BRDF of resolved hits
+    std::vector<std::shared_ptr<Material>> materials;
+    std::unique_ptr<BVH<std::vector<glm::vec3>>> bvh; // null for a scene without triangles
+    std::vector<std::uintptr_t> signature; // of the scene it was built for, see isUpToDate
+};
@@ -0,0 +1,156 @@
+#include "VirtualLights.hpp"
+#include "RayTracer.h"
+#include "BRDF.hpp"
+#include <random>
+#include <limits>
+
+namespace {
+
+struct Emitter {
+    glm::vec3 position;  // origin of point lights
+    glm::vec3 direction; // travel direction of directional lights, zero for point lights
+    glm::vec3 normal;
+    glm::vec3 power;
+};
+
+glm::vec3 orthogonal(glm::vec3 n) {
+    return glm::normalize(glm::cross(n, std::abs(n.x) < 0.9f ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f)));
+}
+
+glm::vec3 sampleCosineHemisphere(glm::vec3 n, float u, float v) {
+    glm::vec3 t = orthogonal(n);
+    glm::vec3 b = glm::cross(n, t);
+    float r = std::sqrt(u);
+    float phi = 2.0f * PI * v;
+    return glm::normalize(t * r * std::cos(phi) + b * r * std::sin(phi) + n * std::sqrt(std::max(0.0f, 1.0f - u)));
+}
+
+glm::vec3 sampleSphere(float u, float v) {
+    float z = 1.0f - 2.0f * u;
+    float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+    float phi = 2.0f * PI * v;
+    return glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+float maxComp(glm::vec3 v) {
+    return std::max(v[0], std::max(v[1], v[2]));
+}
+
+} // namespace
+
+std::vector<std::shared_ptr<PointLight>> VirtualLights::generate(const std::shared_ptr<Scene> scenePtr, const SceneGeometry& geometry, const glm::mat3& invModelViewMatrix, const VPLSettings& settings, const std::vector<std::shared_ptr<PointLight>>& extraLights, const std::atomic<bool>* cancelled) {
+    std::vector<std::shared_ptr<PointLight>> res;
+    if (settings.count <= 0 || scenePtr->numOfMeshes() == 0) {
+        return res;
+    }
+    glm::vec3 lo(std::numeric_limits<float>::max());
+    glm::vec3 hi(-std::numeric_limits<float>::max());
+    for (size_t i = 0; i < scenePtr->numOfMeshes(); i++) {
+        glm::vec3 c;
+        float r;
+        scenePtr->mesh(i)->mesh->computeBoundingSphere(c, r);
+        lo = glm::min(lo, c - glm::vec3(r));
+        hi = glm::max(hi, c + glm::vec3(r));
+    }
+    glm::vec3 center = (lo + hi) * 0.5f;
+    float radius = glm::length(hi - lo) * 0.5f;
+    float eps = 1e-4f * radius;
+
+    // emitted flux of every light, directional ones cover the disk of the scene bounding sphere
+    std::vector<std::shared_ptr<PointLight>> pointLights(extraLights);
+    for (size_t i = 0; i < scenePtr->numOfPLights(); i++) {
+        pointLights.push_back(scenePtr->pLight(i));
+    }
+    std::vector<Emitter> emitters;
+    for (const auto& light : pointLights) {
+        float solidAngle = light->normal == glm::vec3(0.0f) ? 4.0f * PI : PI;
+        emitters.push_back({light->getTranslation(), glm::vec3(0.0f), light->normal, light->color * light->intensity * solidAngle});
+    }
+    std::vector<DirectionalLight> directional;
+    for (size_t i = 0; i < scenePtr->numOfLights(); i++) {
+        auto light = scenePtr->light(i);
+        directional.emplace_back(invModelViewMatrix * light->direction, light->color, light->intensity);
+    }
+    if (scenePtr->environment()) {
+        const auto& samples = scenePtr->environment()->samples();
+        directional.insert(directional.end(), samples.begin(), samples.end());
+    }
+    for (const auto& light : directional) {
+        emitters.push_back({center, glm::normalize(light.direction), glm::vec3(0.0f), light.color * light.intensity * PI * radius * radius});
+    }
+    std::vector<float> cdf;
+    float total = 0.0f;
+    for (const auto& emitter : emitters) {
+        total += maxComp(emitter.power);
+        cdf.push_back(total);
+    }
+    if (!(total > 0.0f)) {
+        return res;
+    }
+
+    struct Deposit {
+        glm::vec3 position;
+        glm::vec3 normal;
+        glm::vec3 flux;
+    };
+    std::vector<Deposit> deposits;
+    deposits.reserve(settings.count);
+    std::mt19937 generator(settings.seed);
+    std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+    long long paths = 0;
+    long long maxPaths = 16ll * settings.count;
+    while ((int)deposits.size() < settings.count && paths < maxPaths) {
+        if (cancelled && paths % 1024 == 0 && *cancelled) {
+            return res;
+        }
+        paths++;
+        // pick an emitter proportionally to its power
+        size_t e = std::min(emitters.size() - 1, (size_t)(std::upper_bound(cdf.begin(), cdf.end(), dist(generator) * total) - cdf.begin()));
+        const Emitter& emitter = emitters[e];
+        glm::vec3 flux = emitter.power * (total / maxComp(emitter.power));
+        glm::vec3 origin;
+        glm::vec3 dir;
+        if (emitter.direction != glm::vec3(0.0f)) {
+            dir = emitter.direction;
+            glm::vec3 t = orthogonal(dir);
+            glm::vec3 b = glm::cross(dir, t);
+            float r = radius * std::sqrt(dist(generator));
+            float phi = 2.0f * PI * dist(generator);
+            origin = emitter.position - dir * (2.0f * radius) + (t * std::cos(phi) + b * std::sin(phi)) * r;
+        } else {
+            origin = emitter.position;
+            dir = emitter.normal == glm::vec3(0.0f) ? sampleSphere(dist(generator), dist(generator)) : sampleCosineHemisphere(glm::normalize(emitter.normal), dist(generator), dist(generator));
+        }
+        for (int bounce = 0; bounce < settings.maxBounces && (int)deposits.size() < settings.count; bounce++) {
+            RayHit hit = raySceneIntersectionBVH(Ray{origin, dir}, geometry);
+            if (hit.t == -1 || !hit.brdf.material) {
+                break;
+            }
+            glm::vec3 pos = origin + dir * hit.t;
+            glm::vec3 n = glm::dot(hit.normal, dir) > 0.0f ? -hit.normal : hit.normal;
+            glm::vec3 reflectance = glm::vec3(hit.brdf.material->albedo) * hit.brdf.material->kd;
+            // diffuse reflector: radiant intensity flux * reflectance / PI along the normal, cosine falloff
+            deposits.push_back({pos + n * eps, n, flux * reflectance / PI});
+            // continue the path with russian roulette on the reflectance
+            float survival = std::min(1.0f, maxComp(reflectance));
+            if (!(survival > 0.0f) || dist(generator) >= survival) {
+                break;
+            }
+            flux *= reflectance / survival;
+            origin = pos + n * eps;
+            dir = sampleCosineHemisphere(n, dist(generator), dist(generator));
+        }
+    }
+
+    res.reserve(deposits.size());
+    for (const auto& deposit : deposits) {
+        glm::vec3 value = deposit.flux / (float)paths;
+        float scale = maxComp(value);
+        if (!(scale > 0.0f)) {
+            continue;
+        }
+        float intensity = settings.clamp > 0.0f ? std::min(scale, settings.clamp) : scale;
+        res.push_back(std::make_shared<PointLight>(deposit.position, value / scale, intensity, deposit.normal));
+    }
+    return res;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include "Scene.h"
+#include "SceneGeometry.hpp"
+#include "LightSource.hpp"
+#include <atomic>
+#include <memory>
+#include <vector>
+
+/// Instant radiosity settings.
+struct VPLSettings {
+    int count = 0;          // number of VPLs to deposit, 0 disables indirect lighting
+    int maxBounces = 3;     // VPLs deposited along one light path at most
+    float clamp = 0.0f;     // max VPL intensity, 0 for no clamping
+    unsigned int seed = 0;
+};
+
+/// Virtual point lights: light paths traced from the emitters through the scene BVH leave oriented diffuse
+/// point lights on the surfaces they hit, which then stand for the one-bounce-and-more indirect lighting.
+namespace VirtualLights {
+    /// Emitters are the scene point lights, the extra lights (e.g. area light samples), the scene directional lights
+    /// (camera space, turned to world space with invModelViewMatrix) and its environment samples.
+    /// Light paths are traced through geometry, built for the scene. Returns no light once cancelled is set.
+    std::vector<std::shared_ptr<PointLight>> generate(const std::shared_ptr<Scene> scenePtr, const SceneGeometry& geometry, const glm::mat3& invModelViewMatrix, const VPLSettings& settings, const std::vector<std::shared_ptr<PointLight>>& extraLights = {}, const std::atomic<bool>* cancelled = nullptr);
+}